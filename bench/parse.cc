@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include "raytrace.h"
+#include "filemanip.h"
+
+// Measures how long a generated scene of SPHERES spheres takes to load: its values alone through std::istream the way
+// the readers used to parse them and through FileManip::SceneStream, then the whole scene through FileManip::readFile,
+// as text and compiled. The scenes are written to DIR and removed when done.
+// $ bin/bench_parse [ SPHERES = 1000000 ] [ DIR = /tmp ]
+
+namespace {
+
+    void WriteScene (const std::string &name, unsigned spheres) {
+
+        std::ofstream output(name);
+        std::minstd_rand generator(42);
+        std::uniform_real_distribution<float_max_t> position(-100.0, 100.0), radius(0.05, 0.5);
+
+        output << "0 0 -150\n0 0 0\n0 1 0\n40\n"
+               << "2\n0 0 0 .2 .2 .2 0 0 0\n0 100 -100 1 1 1 1 0 0\n"
+               << "2\nsolid .8 .2 .2\nchecker .1 .1 .1 .9 .9 .9 2\n"
+               << "1\n.1 .7 .3 20 .1 0 1\n"
+               << spheres << "\n";
+
+        for (unsigned i = 0; i < spheres; ++i) {
+            output << i % 2 << " 0 sphere " << position(generator) << ' ' << position(generator) << ' '
+                   << position(generator) << ' ' << radius(generator) << '\n';
+        }
+    }
+
+    // Reads the values of a scene written by WriteScene without building anything from them
+    template <typename Input>
+    float_max_t Scan (Input &input) {
+
+        Geometry::Vec<3> vector;
+        float_max_t number, total = 0.0;
+        unsigned count;
+        std::string word;
+
+        input >> vector >> vector >> vector >> number >> count;
+        for (unsigned i = 0; i < count; ++i) {
+            input >> vector >> vector >> number >> number >> number;
+        }
+        input >> count >> word >> vector >> word >> vector >> vector >> number >> count;
+        for (unsigned i = 0; i < count; ++i) {
+            input >> number >> number >> number >> number >> number >> number >> number;
+        }
+        input >> count;
+        for (unsigned i = 0; i < count; ++i) {
+            input >> number >> number >> word >> vector >> number;
+            total += vector[0] + number;
+        }
+
+        return total;
+    }
+}
+
+int main (int argc, const char *argv[]) {
+
+    const unsigned spheres = argc > 1 ? std::stoi(argv[1]) : 1000000;
+    const std::string directory = argc > 2 ? argv[2] : "/tmp", text = directory + "/bench_parse.in", compiled = directory + "/bench_parse.rts";
+
+    WriteScene(text, spheres);
+
+    if (!FileManip::compileFile(text, "./", compiled)) {
+        std::cerr << "Could not compile " << text << std::endl;
+        return 1;
+    }
+
+    auto measure = [ & ] (const std::string &name, const std::function<float_max_t()> &load) {
+        const auto start = std::chrono::high_resolution_clock::now();
+        const float_max_t checksum = load();
+        const float_max_t elapsed = std::chrono::duration_cast<std::chrono::duration<float_max_t>>(
+            std::chrono::high_resolution_clock::now() - start
+        ).count();
+        std::cout << name << ": " << elapsed << " seconds, " << spheres / elapsed / 1e6 << " million spheres per second (checksum " << checksum << ")" << std::endl;
+    };
+
+    auto load = [ & ] (const std::string &name) {
+        return [ &, name ] () -> float_max_t {
+            RayTrace::Scene scene;
+            FileManip::readFile(name, "./", scene);
+            return scene.infos.empty() ? 0.0 : scene.infos.back().params[3] + scene.hierarchies.size();
+        };
+    };
+
+    for (unsigned round = 0; round < 2; ++round) {
+        measure("values, std::istream", [ & ] {
+            std::ifstream input(text);
+            return Scan(input);
+        });
+        measure("values, SceneStream", [ & ] {
+            const FileManip::MappedFile file(text);
+            FileManip::SceneStream input(file.getData(), file.getSize());
+            return Scan(input);
+        });
+        measure("readFile, text", load(text));
+        measure("readFile, compiled", load(compiled));
+    }
+
+    std::remove(text.c_str());
+    std::remove(compiled.c_str());
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "pigments.h"
+
+// Measures texture samples per second of the checker and moisture pigments, as type-erased Pigment::Procedural
+// lambdas the way the loader used to build them and as the RayTrace pigments that replaced them. Fails when the
+// replacements do not give the same colors, or RayTrace::PerlinNoise the same noise as Pigment::PerlinNoise.
+// $ bin/bench_pigments [ SAMPLES = 4000000 ]
+
+namespace {
+
+    Pigment::Procedural *LambdaChecker (const Pigment::Color &checker_color_1, const Pigment::Color &checker_color_2, float_max_t checker_size) {
+
+        const Pigment::Color avg_checker((checker_color_1 + checker_color_2) * 0.5);
+
+        return new Pigment::Procedural([ checker_color_1, checker_color_2, avg_checker ] (const Geometry::Vec<2> &param) {
+
+            const float_max_t
+                s = Geometry::fract(param[0]),
+                t = Geometry::fract(param[1]);
+
+            if (Geometry::closeToZero(s) || Geometry::closeTo(s, 0.5) || Geometry::closeTo(s, 1.0) ||
+                Geometry::closeToZero(t) || Geometry::closeTo(t, 0.5) || Geometry::closeTo(t, 1.0)) {
+                return avg_checker;
+            }
+
+            const bool right = std::round(s) > 0.5, top = std::round(t) > 0.5;
+
+            if ((top && right) || !(top || right)) {
+                return checker_color_1;
+            }
+
+            return checker_color_2;
+
+        }, checker_size, checker_size);
+    }
+
+    Pigment::Procedural *LambdaMoisture (const Pigment::Color &moisture_color_1, const Pigment::Color &moisture_color_2, float_max_t moisture_size, unsigned seed) {
+
+        Pigment::PerlinNoise noise;
+
+        noise.shuffle(seed);
+
+        return new Pigment::Procedural([ moisture_color_1, moisture_color_2, noise ] (const Geometry::Vec<2> &param) mutable -> Pigment::Color {
+
+            float_max_t
+                s = std::fmod(param[0], 500.0) + 500.0,
+                t = std::fmod(param[1], 500.0) + 500.0,
+                value = (1.0 + std::sin((s + noise.at(s * 5.0, t * 5.0, 0.0) * 0.5) * 50.0)) * 0.5;
+
+            return value * moisture_color_1 + (-value + 1.0) * moisture_color_2;
+
+        }, moisture_size, moisture_size);
+    }
+}
+
+int main (int argc, const char *argv[]) {
+
+    const unsigned samples = argc > 1 ? std::stoi(argv[1]) : 4000000;
+
+    const Pigment::Color color_1(0.08, 0.25, 0.20), color_2(0.93, 0.83, 0.82);
+    const Geometry::Vec<3> point({ 0.0, 0.0, 0.0 });
+
+    std::vector<float_max_t> s(samples), t(samples);
+    std::minstd_rand generator(42);
+    std::uniform_real_distribution<float_max_t> uniform(-1000.0, 1000.0);
+
+    for (unsigned i = 0; i < samples; ++i) {
+        s[i] = uniform(generator);
+        t[i] = uniform(generator);
+    }
+
+    std::vector<Pigment::Color> colors(samples);
+
+    // Noise tables built from the same seed must agree everywhere, lattice points excepted since every table gives
+    // one half there
+    {
+        Pigment::PerlinNoise library;
+        library.shuffle(7);
+        const RayTrace::PerlinNoise noise(7);
+
+        unsigned mismatches = 0;
+
+        for (unsigned i = 0; i < samples && i < 100000; ++i) {
+            const float_max_t x = s[i] * 0.37, y = t[i] * 0.37, z = (s[i] - t[i]) * 0.11;
+            mismatches += library.at(x, y, z) != noise.at(x, y, z);
+        }
+
+        if (mismatches > 0) {
+            std::cerr << "RayTrace::PerlinNoise differs from Pigment::PerlinNoise at " << mismatches << " points." << std::endl;
+            return 1;
+        }
+    }
+
+    // Sums the colors so that no loop can be optimized away, and returns the sum
+    auto measure = [ & ] (const std::string &name, const std::function<void()> &sample) {
+        const auto start = std::chrono::high_resolution_clock::now();
+        sample();
+        const float_max_t elapsed = std::chrono::duration_cast<std::chrono::duration<float_max_t>>(
+            std::chrono::high_resolution_clock::now() - start
+        ).count();
+        Pigment::Color total(0.0, 0.0, 0.0);
+        for (const Pigment::Color &color : colors) {
+            total += color;
+        }
+        const float_max_t checksum = total[0] + total[1] + total[2];
+        std::cout << name << ": " << samples / elapsed / 1e6 << " million samples per second (checksum " << checksum << ")" << std::endl;
+        return checksum;
+    };
+
+    auto same = [ ] (const std::string &name, float_max_t lambda, float_max_t replaced) {
+        if (lambda != replaced) {
+            std::cerr << name << ": the checksums of the lambda and the RayTrace pigment differ." << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    auto scalar = [ & ] (const Pigment::Texture *texture) {
+        return [ &, texture ] () {
+            for (unsigned i = 0; i < samples; ++i) {
+                colors[i] = texture->getColor({ s[i], t[i] }, point);
+            }
+        };
+    };
+
+    const Pigment::Texture
+        *lambda_checker = LambdaChecker(color_1, color_2, 80.0),
+        *lambda_moisture = LambdaMoisture(color_1, color_2, 10.0, 7);
+    const RayTrace::Checker checker(color_1, color_2, 80.0);
+    const RayTrace::Moisture moisture(color_1, color_2, 10.0, 7);
+
+    bool agree = true;
+
+    for (unsigned round = 0; round < 2; ++round) {
+        const float_max_t
+            checker_lambda = measure("checker, lambda", scalar(lambda_checker)),
+            checker_virtual = measure("checker, virtual", scalar(&checker)),
+            checker_batch = measure("checker, batch", [ & ] { checker.getColors(s.data(), t.data(), samples, colors.data()); }),
+            moisture_lambda = measure("moisture, lambda", scalar(lambda_moisture)),
+            moisture_virtual = measure("moisture, virtual", scalar(&moisture)),
+            moisture_batch = measure("moisture, batch", [ & ] { moisture.getColors(s.data(), t.data(), samples, colors.data()); });
+        agree = same("checker, virtual", checker_lambda, checker_virtual) && agree;
+        agree = same("checker, batch", checker_lambda, checker_batch) && agree;
+        agree = same("moisture, virtual", moisture_lambda, moisture_virtual) && agree;
+        agree = same("moisture, batch", moisture_lambda, moisture_batch) && agree;
+    }
+
+    return agree ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "raytrace.h"
+#include "filemanip.h"
+
+// Loads, renders and frees the same scene ROUNDS times in one process, the way a server rendering scene after scene
+// would, and reports the time to load and to free it and the resident memory after every round. Every round must
+// render the same image, and resident memory must stop growing after the first few. Run it under AddressSanitizer
+// to also catch state kept across scenes that points into one already freed.
+// $ bin/bench_reload [ SCENE = tests/test4.in ] [ ROUNDS = 20 ] [ SIDE = 32 ]
+
+namespace {
+
+    // Resident set in KiB, 0 where /proc is not there to tell
+    unsigned long ResidentMemory () {
+        std::ifstream statm("/proc/self/statm");
+        unsigned long pages = 0, resident = 0;
+        statm >> pages >> resident;
+        return resident * 4;
+    }
+
+    float_max_t Milliseconds (std::chrono::high_resolution_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::duration<float_max_t, std::milli>>(
+            std::chrono::high_resolution_clock::now() - start
+        ).count();
+    }
+}
+
+int main (int argc, const char *argv[]) {
+
+    const std::string scene_file = argc > 1 ? argv[1] : "tests/test4.in";
+    const unsigned
+        rounds = argc > 2 ? std::stoi(argv[2]) : 20,
+        side = argc > 3 ? std::stoi(argv[3]) : 32;
+
+    const std::vector<Geometry::Vec<2>> light_deviations = { { 0.0, 0.0 }, { 0.1, 0.1 }, { -0.1, -0.1 } };
+    const Pigment::Color background(0.5, 0.5, 0.5, 0.0);
+
+    float_max_t first_checksum = 0.0;
+    bool same = true;
+
+    for (unsigned round = 0; round < rounds; ++round) {
+
+        std::unique_ptr<RayTrace::Scene> scene(new RayTrace::Scene());
+        std::string error;
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        if (!FileManip::readFile(scene_file, "./", *scene, &error)) {
+            std::cerr << "Could not read '" << scene_file << "': " << error << "." << std::endl;
+            return 1;
+        }
+
+        const float_max_t load = Milliseconds(start);
+        float_max_t checksum = 0.0;
+
+        {
+            const RayTrace::ShapeSet shape_set(scene->shapes, scene->infos, scene->hierarchies);
+            const RayTrace::LightSet light_set(scene->lights);
+
+            const float_max_t scale = std::tan(scene->camera.getFieldOfView() * 0.5);
+            const Geometry::Vec<3>
+                eye = scene->camera.getPosition(),
+                forward = scene->camera.getDirection(),
+                right = forward.cross(scene->camera.getUpDirection()).normalized(),
+                up = right.cross(forward);
+
+            for (unsigned y = 0; y < side; ++y) {
+                for (unsigned x = 0; x < side; ++x) {
+                    const float_max_t
+                        u = ((x + 0.5) * 2.0 / side - 1.0) * scale,
+                        v = (1.0 - (y + 0.5) * 2.0 / side) * scale;
+                    const Pigment::Color color = RayTrace::Trace(
+                        Geometry::Line(eye, (forward + u * right + v * up).normalized()),
+                        shape_set, scene->ambient, light_set, light_deviations, { { { 0.0, 0.0 }, 1.0 } }, { { { 0.0, 0.0 }, 1.0 } },
+                        background, 4
+                    );
+                    checksum += color[0] + color[1] + color[2];
+                }
+            }
+        }
+
+        const std::size_t footprint = scene->arena.getFootprint();
+
+        start = std::chrono::high_resolution_clock::now();
+        scene.reset();
+        const float_max_t release = Milliseconds(start);
+
+        if (round == 0) {
+            first_checksum = checksum;
+        }
+        same = same && checksum == first_checksum;
+
+        std::cout << "round " << round << ": load " << load << " ms, free " << release << " ms, arena "
+                  << footprint / 1024 << " KiB, resident " << ResidentMemory() << " KiB (checksum " << checksum << ")" << std::endl;
+    }
+
+    if (!same) {
+        std::cerr << "The rounds rendered different images." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
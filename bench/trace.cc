@@ -0,0 +1,210 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include "raytrace.h"
+#include "filemanip.h"
+
+// Measures the time per camera ray of RayTrace::Trace against the recursive tracer it replaced, on the same scene.
+// $ bin/bench_trace [ SCENE = tests/test4.in ] [ RECURSE = 10 ] [ SIDE = 64 ]
+
+namespace {
+
+    typedef std::vector<std::pair<Geometry::Vec<2>, float_max_t>> Deviations;
+
+    // The recursive Trace as it was before the ray stack, kept as the reference to compare against
+    Pigment::Color TraceRecursive (
+        const Geometry::Line &line,
+        const RayTrace::ShapeSet &shapes,
+        Pigment::Color ambient,
+        const RayTrace::LightSet &lights,
+        const std::vector<Geometry::Vec<2>> &light_deviations,
+        const Deviations &reflect_deviations,
+        const Deviations &transmit_deviations,
+        Pigment::Color color,
+        unsigned jumps
+    ) {
+
+        RayTrace::Hit hit;
+        Geometry::Vec<3> normal;
+        Pigment::Color pigment;
+        RayTrace::Material material;
+        bool inside;
+
+        if (!RayTrace::Intersect(line, shapes, hit)) {
+            return color;
+        }
+
+        RayTrace::Shade(line, shapes, hit, normal, inside, pigment, material);
+
+        const Geometry::Vec<3> &point = line.at(hit.distance);
+
+        Pigment::Color
+            reflected(0.0, 0.0, 0.0),
+            transmitted(0.0, 0.0, 0.0),
+            accumulated(0.0, 0.0, 0.0);
+
+        normal += material.getNormal();
+
+        if (jumps > 0) {
+
+            if (material.getReflect() > Geometry::EPSILON) {
+                const Geometry::Vec<3>
+                    reflect = (-2.0 * normal.dot(line.getDirection()) * normal + line.getDirection()).normalized(),
+                    up_dir = reflect.perpendicular().normalized(),
+                    right_dir = reflect.cross(up_dir).normalized(),
+                    hit_point = point + reflect * 5.0;
+
+                Pigment::Color reflect_accumulated(0.0, 0.0, 0.0);
+                float_max_t total_weight = 0.0;
+
+                for (const auto &deviation : reflect_deviations) {
+                    const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
+                    reflect_accumulated += TraceRecursive(
+                        Geometry::Line(point + dir * Geometry::EPSILON, dir),
+                        shapes, ambient, lights, light_deviations, reflect_deviations, transmit_deviations, color, jumps - 1
+                    ) * deviation.second;
+                    total_weight += deviation.second;
+                }
+
+                reflected += (reflect_accumulated / total_weight) * material.getReflect();
+            }
+
+            if (material.getTransmit() > Geometry::EPSILON) {
+                const float_max_t
+                    nr = inside ? material.getIOR() : (1.0 / material.getIOR()),
+                    ndl = normal.dot(-line.getDirection()),
+                    root = 1.0 - (nr * nr) * (1.0 - (ndl * ndl));
+                if (root >= 0.0) {
+                    const Geometry::Vec<3>
+                        transmit = ((nr * ndl - std::sqrt(root)) * normal - nr * (-line.getDirection())).normalized(),
+                        up_dir = transmit.perpendicular().normalized(),
+                        right_dir = transmit.cross(up_dir).normalized(),
+                        hit_point = point + transmit * 5.0;
+
+                    Pigment::Color transmit_accumulated(0.0, 0.0, 0.0);
+                    float_max_t total_weight = 0.0;
+
+                    for (const auto &deviation : transmit_deviations) {
+                        const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
+                        transmit_accumulated += TraceRecursive(
+                            Geometry::Line(point + dir * Geometry::EPSILON, dir),
+                            shapes, ambient, lights, light_deviations, reflect_deviations, transmit_deviations, color, jumps - 1
+                        ) * deviation.second;
+                        total_weight += deviation.second;
+                    }
+
+                    transmitted += (transmit_accumulated / total_weight) * material.getTransmit();
+                }
+            }
+        }
+
+        ambient *= material.getAmbient() * pigment;
+
+        if (material.getSpecular() > Geometry::EPSILON || material.getDiffuse() > Geometry::EPSILON) {
+
+            // Most the point can send back for a light of unit intensity. The light set below culls nothing, so
+            // leaving out the weights of the rays above changes no result.
+            const float_max_t reach = material.getDiffuse() * std::max(std::max(pigment[0], pigment[1]), pigment[2]) + material.getSpecular();
+
+            lights.visit(point, reach, 0, [ & ] (unsigned light_index, float_max_t light_weight) {
+
+                const Light::Light *light = lights[light_index];
+
+                Pigment::Color light_accumulated(0.0, 0.0, 0.0);
+
+                const Geometry::Vec<3> delta = light->getPosition() - point;
+                const float_max_t light_distance = delta.length();
+                const Geometry::Vec<3>
+                    direction = delta / light_distance,
+                    up_dir = direction.perpendicular().normalized(),
+                    right_dir = direction.cross(up_dir).normalized();
+
+                for (const auto &deviation : light_deviations) {
+                    const Geometry::Vec<3> dir = ((light->getPosition() + deviation[0] * right_dir + deviation[1] * up_dir) - point).normalized();
+
+                    if (!RayTrace::Occluded(Geometry::Line(point + dir * Geometry::EPSILON, dir), shapes, light_distance)) {
+                        const Geometry::Vec<3> h = ((dir - line.getDirection()) / 2).normalized();
+                        const float_max_t
+                            attenuation = 1.0 / (
+                                light->getConstantAttenuation() +
+                                light_distance * light->getLinearAttenuation() +
+                                light_distance * light_distance * light->getQuadraticAttenuation()
+                            ),
+                            diffuse = std::max(normal.dot(dir), 0.0) * material.getDiffuse(),
+                            specular = std::pow(normal.dot(h), material.getAlpha()) * material.getSpecular();
+
+                        light_accumulated += ((diffuse * pigment) + specular) * light->getColor() * attenuation;
+                    }
+                }
+
+                accumulated += light_accumulated * light_weight / light_deviations.size();
+            });
+        }
+
+        return reflected + ambient + accumulated + transmitted;
+    }
+}
+
+int main (int argc, const char *argv[]) {
+
+    const std::string scene_file = argc > 1 ? argv[1] : "tests/test4.in";
+    const unsigned
+        recurse = argc > 2 ? std::stoi(argv[2]) : 10,
+        side = argc > 3 ? std::stoi(argv[3]) : 64;
+
+    RayTrace::Scene scene;
+
+    if (!FileManip::readFile(scene_file, "./", scene)) {
+        std::cerr << "Could not read '" << scene_file << "'." << std::endl;
+        return 1;
+    }
+
+    const RayTrace::ShapeSet shape_set(scene.shapes, scene.infos);
+    const RayTrace::LightSet light_set(scene.lights);
+    const std::vector<Geometry::Vec<2>> light_deviations = { { 0.0, 0.0 } };
+    const Deviations deviations = { { { 0.0, 0.0 }, 1.0 } };
+    const Pigment::Color background(0.5, 0.5, 0.5, 0.0);
+
+    const float_max_t scale = std::tan(scene.camera.getFieldOfView() * 0.5);
+    const Geometry::Vec<3>
+        eye = scene.camera.getPosition(),
+        forward = scene.camera.getDirection(),
+        right = forward.cross(scene.camera.getUpDirection()).normalized(),
+        up = right.cross(forward);
+
+    std::vector<Geometry::Line> lines;
+
+    for (unsigned y = 0; y < side; ++y) {
+        for (unsigned x = 0; x < side; ++x) {
+            const float_max_t
+                u = ((x + 0.5) * 2.0 / side - 1.0) * scale,
+                v = (1.0 - (y + 0.5) * 2.0 / side) * scale;
+            lines.emplace_back(eye, (forward + u * right + v * up).normalized());
+        }
+    }
+
+    // Sums the colors so that neither loop can be optimized away
+    auto measure = [ & ] (const char *name, const std::function<Pigment::Color(const Geometry::Line &)> &trace) {
+        Pigment::Color total(0.0, 0.0, 0.0);
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (const Geometry::Line &line : lines) {
+            total += trace(line);
+        }
+        const float_max_t elapsed = std::chrono::duration_cast<std::chrono::duration<float_max_t, std::nano>>(
+            std::chrono::high_resolution_clock::now() - start
+        ).count();
+        std::cout << name << ": " << elapsed / lines.size() << " ns per camera ray (checksum " << total[0] + total[1] + total[2] << ")" << std::endl;
+    };
+
+    for (unsigned round = 0; round < 2; ++round) {
+        measure("recursive", [ & ] (const Geometry::Line &line) {
+            return TraceRecursive(line, shape_set, scene.ambient, light_set, light_deviations, deviations, deviations, background, recurse);
+        });
+        measure("iterative", [ & ] (const Geometry::Line &line) {
+            return RayTrace::Trace(line, shape_set, scene.ambient, light_set, light_deviations, deviations, deviations, background, recurse);
+        });
+    }
+
+    return 0;
+}
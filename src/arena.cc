@@ -0,0 +1,45 @@
+#include <algorithm>
+#include <cstdint>
+#include "arena.h"
+
+namespace RayTrace {
+
+    constexpr std::size_t Arena::LAST_BLOCK;
+
+    namespace {
+
+        inline std::size_t padding (const char *pointer, std::size_t alignment) {
+            return (alignment - reinterpret_cast<std::uintptr_t>(pointer) % alignment) % alignment;
+        }
+    }
+
+    void *Arena::allocate (std::type_index type, std::size_t size, std::size_t alignment) {
+
+        Pool &pool = this->pools[type];
+        std::size_t skip = padding(pool.data + pool.offset, alignment);
+
+        if (pool.data == nullptr || pool.offset + skip + size > pool.capacity) {
+            // Blocks double up to LAST_BLOCK, and objects larger than that get one of their own
+            pool.capacity = std::max(pool.block, size + alignment);
+            pool.block = std::min(pool.block * 2, LAST_BLOCK);
+            this->blocks.emplace_back(new char[pool.capacity]);
+            this->footprint += pool.capacity;
+            pool.data = this->blocks.back().get();
+            pool.offset = 0;
+            skip = padding(pool.data, alignment);
+        }
+
+        char *start = pool.data + pool.offset + skip;
+        pool.offset += skip + size;
+        this->used += size;
+
+        return start;
+    }
+
+    Arena::~Arena () {
+        std::for_each(this->destructors.rbegin(), this->destructors.rend(), [] (const Destructor &destructor) {
+            destructor.destroy(destructor.object);
+        });
+    }
+
+};
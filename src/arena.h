@@ -0,0 +1,71 @@
+#ifndef SRC_ARENA_H_
+#define SRC_ARENA_H_
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace RayTrace {
+
+    // Bump allocator with a run of blocks for every type, so that objects of one type lie next to each other.
+    // Everything it made is destroyed along with it, newest first, and its blocks are then freed all at once.
+    class Arena {
+
+        static constexpr std::size_t
+            FIRST_BLOCK = 4096,
+            LAST_BLOCK = 1 << 20;
+
+        struct Pool {
+            char *data = nullptr;
+            std::size_t offset = 0, capacity = 0, block = FIRST_BLOCK;
+        };
+
+        struct Destructor {
+            void *object;
+            void (*destroy)(void *);
+        };
+
+        std::unordered_map<std::type_index, Pool> pools;
+        std::vector<std::unique_ptr<char[]>> blocks;
+        std::vector<Destructor> destructors;
+        std::size_t footprint = 0, used = 0;
+
+        void *allocate (std::type_index type, std::size_t size, std::size_t alignment);
+
+    public:
+
+        Arena () {}
+        Arena (const Arena &) = delete;
+        Arena &operator= (const Arena &) = delete;
+        ~Arena ();
+
+        template <typename T, typename... Arguments>
+        T *make (Arguments &&... arguments) {
+            T *object = this->place<T>(std::forward<Arguments>(arguments)...);
+            if (!std::is_trivially_destructible<T>::value) {
+                this->destructors.push_back({ object, [] (void *pointer) { static_cast<T *>(pointer)->~T(); } });
+            }
+            return object;
+        }
+
+        // Same as make, but the object is never destroyed, only its memory freed with the rest
+        template <typename T, typename... Arguments>
+        T *place (Arguments &&... arguments) {
+            return new (this->allocate(typeid(T), sizeof(T), alignof(T))) T(std::forward<Arguments>(arguments)...);
+        }
+
+        // Bytes held in blocks, and how many of them objects take
+        inline std::size_t getFootprint () const { return this->footprint; }
+        inline std::size_t getUsed () const { return this->used; }
+        inline std::size_t getBlocks () const { return this->blocks.size(); }
+    };
+
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include <atomic>
+#include <numeric>
+#include "bvh.h"
+
+namespace RayTrace {
+
+    namespace {
+
+        struct Bin {
+            Bounds bounds;
+            unsigned count = 0;
+        };
+
+        constexpr unsigned MAX_SAH_DEPTH = 32;
+
+        // Intersection tests needed for count shapes when batch of them are tested at once
+        inline float_max_t batches (unsigned count, unsigned batch) {
+            return (count + batch - 1) / batch;
+        }
+
+        unsigned allocatePair (std::atomic<unsigned> &next_node) {
+            return next_node.fetch_add(2);
+        }
+
+        void buildNode (
+            std::vector<BVH::Node> &nodes,
+            std::vector<unsigned> &indices,
+            const std::vector<Bounds> &bounds,
+            std::atomic<unsigned> &next_node,
+            unsigned node_index,
+            unsigned begin,
+            unsigned end,
+            unsigned depth,
+            unsigned bins_count,
+            unsigned max_leaf,
+            unsigned batch,
+            unsigned parallel_threshold
+        ) {
+
+            Bounds node_bounds, centroid_bounds;
+
+            for (unsigned i = begin; i < end; ++i) {
+                const Bounds &current = bounds[indices[i]];
+                node_bounds.extend(current);
+                for (unsigned axis = 0; axis < 3; ++axis) {
+                    const float_max_t centroid = current.centroid(axis);
+                    centroid_bounds.min[axis] = std::min(centroid_bounds.min[axis], centroid);
+                    centroid_bounds.max[axis] = std::max(centroid_bounds.max[axis], centroid);
+                }
+            }
+
+            BVH::Node &node = nodes[node_index];
+            for (unsigned i = 0; i < 3; ++i) {
+                node.min[i] = NarrowDown(node_bounds.min[i]);
+                node.max[i] = NarrowUp(node_bounds.max[i]);
+            }
+            node.axis = 0;
+
+            const unsigned count = end - begin;
+
+            unsigned axis = 0;
+            for (unsigned i = 1; i < 3; ++i) {
+                if (centroid_bounds.max[i] - centroid_bounds.min[i] > centroid_bounds.max[axis] - centroid_bounds.min[axis]) {
+                    axis = i;
+                }
+            }
+
+            // Shapes whose centroids all coincide cannot be told apart, and are split in halves by count down to
+            // max_leaf so that no leaf outgrows it
+            if (count <= 1 || (centroid_bounds.max[axis] - centroid_bounds.min[axis] <= 0.0 && count <= max_leaf)) {
+                node.offset = begin;
+                node.count = count;
+                return;
+            }
+
+            unsigned middle;
+
+            if (depth < MAX_SAH_DEPTH) {
+
+                // Binned surface area heuristic over all three axes
+                float_max_t best_cost = std::numeric_limits<float_max_t>::max();
+                unsigned best_axis = axis, best_split = 0;
+
+                std::vector<Bin> bins(bins_count);
+                std::vector<float_max_t> right_area(bins_count);
+                std::vector<unsigned> right_count(bins_count);
+
+                for (unsigned current_axis = 0; current_axis < 3; ++current_axis) {
+
+                    const float_max_t
+                        low = centroid_bounds.min[current_axis],
+                        extent = centroid_bounds.max[current_axis] - low;
+
+                    if (extent <= 0.0) {
+                        continue;
+                    }
+
+                    const float_max_t scale = bins_count / extent;
+
+                    std::fill(bins.begin(), bins.end(), Bin());
+
+                    for (unsigned i = begin; i < end; ++i) {
+                        const Bounds &current = bounds[indices[i]];
+                        const unsigned bin = std::min(bins_count - 1, static_cast<unsigned>((current.centroid(current_axis) - low) * scale));
+                        bins[bin].bounds.extend(current);
+                        ++bins[bin].count;
+                    }
+
+                    Bounds accumulated;
+                    unsigned accumulated_count = 0;
+                    for (unsigned i = bins_count - 1; i > 0; --i) {
+                        accumulated.extend(bins[i].bounds);
+                        accumulated_count += bins[i].count;
+                        right_area[i] = accumulated.area();
+                        right_count[i] = accumulated_count;
+                    }
+
+                    accumulated = Bounds();
+                    accumulated_count = 0;
+                    for (unsigned i = 0; i < bins_count - 1; ++i) {
+                        accumulated.extend(bins[i].bounds);
+                        accumulated_count += bins[i].count;
+                        const float_max_t cost = accumulated.area() * batches(accumulated_count, batch) + right_area[i + 1] * batches(right_count[i + 1], batch);
+                        if (accumulated_count > 0 && right_count[i + 1] > 0 && cost < best_cost) {
+                            best_cost = cost;
+                            best_axis = current_axis;
+                            best_split = i;
+                        }
+                    }
+                }
+
+                const float_max_t leaf_cost = node_bounds.area() * batches(count, batch);
+
+                // Relative traversal cost of one extra level, measured against one shape intersection
+                best_cost = best_cost + node_bounds.area() * 0.125;
+
+                if (best_cost >= leaf_cost && count <= max_leaf) {
+                    node.offset = begin;
+                    node.count = count;
+                    return;
+                }
+
+                if (best_cost < std::numeric_limits<float_max_t>::max()) {
+                    const float_max_t
+                        low = centroid_bounds.min[best_axis],
+                        scale = bins_count / (centroid_bounds.max[best_axis] - low);
+
+                    axis = best_axis;
+                    middle = std::partition(indices.begin() + begin, indices.begin() + end, [ & ] (unsigned index) {
+                        return std::min(bins_count - 1, static_cast<unsigned>((bounds[index].centroid(best_axis) - low) * scale)) <= best_split;
+                    }) - indices.begin();
+                } else {
+                    middle = begin;
+                }
+
+            } else {
+                middle = begin;
+            }
+
+            if (middle == begin || middle == end) {
+                middle = begin + count / 2;
+                std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end, [ & ] (unsigned first, unsigned second) {
+                    return bounds[first].centroid(axis) < bounds[second].centroid(axis);
+                });
+            }
+
+            const unsigned children = allocatePair(next_node);
+
+            node.offset = children;
+            node.count = 0;
+            node.axis = axis;
+
+            if (count > parallel_threshold) {
+                #pragma omp task default(shared) firstprivate(children, begin, middle, depth, bins_count, max_leaf, batch, parallel_threshold)
+                buildNode(nodes, indices, bounds, next_node, children, begin, middle, depth + 1, bins_count, max_leaf, batch, parallel_threshold);
+            } else {
+                buildNode(nodes, indices, bounds, next_node, children, begin, middle, depth + 1, bins_count, max_leaf, batch, parallel_threshold);
+            }
+            buildNode(nodes, indices, bounds, next_node, children + 1, middle, end, depth + 1, bins_count, max_leaf, batch, parallel_threshold);
+        }
+    }
+
+    constexpr float_trace_t BVH::SLACK;
+
+    void BVH::build (const std::vector<Bounds> &bounds, unsigned max_leaf, unsigned batch) {
+
+        this->nodes.clear();
+        this->indices.resize(bounds.size());
+        std::iota(this->indices.begin(), this->indices.end(), 0);
+
+        if (bounds.empty()) {
+            return;
+        }
+
+        this->nodes.resize(2 * bounds.size() - 1);
+
+        std::atomic<unsigned> next_node(1);
+
+        #pragma omp parallel
+        #pragma omp single
+        buildNode(this->nodes, this->indices, bounds, next_node, 0, 0, bounds.size(), 0, BINS, max_leaf, batch, PARALLEL_THRESHOLD);
+
+        this->nodes.resize(next_node.load());
+    }
+
+    bool BVH::fits (const std::vector<Bounds> &bounds) const {
+
+        const unsigned count = bounds.size();
+
+        if (this->indices.size() != count || this->nodes.empty() != (count == 0)) {
+            return false;
+        }
+
+        std::vector<bool> seen(count, false);
+        for (unsigned index : this->indices) {
+            if (index >= count || seen[index]) {
+                return false;
+            }
+            seen[index] = true;
+        }
+
+        // Children always come after their parent, so depths are known by the time a node is checked
+        std::vector<unsigned> depth(this->nodes.size(), 0);
+        for (unsigned i = 0; i < this->nodes.size(); ++i) {
+            const Node &node = this->nodes[i];
+            if (node.count > 0) {
+                if (node.offset > count || node.count > count - node.offset) {
+                    return false;
+                }
+            } else {
+                if (node.offset <= i || node.offset >= this->nodes.size() - 1 || node.axis > 2 || depth[i] + 1 >= STACK_SIZE) {
+                    return false;
+                }
+                depth[node.offset] = depth[node.offset + 1] = depth[i] + 1;
+            }
+        }
+
+        // Traversal skips whatever a node does not hold, so leaves must hold their shapes and parents their children
+        const auto holds = [] (const Node &node, const float_trace_t min[3], const float_trace_t max[3]) {
+            for (unsigned i = 0; i < 3; ++i) {
+                if (!(node.min[i] <= min[i] && node.max[i] >= max[i])) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        for (const Node &node : this->nodes) {
+            if (node.count > 0) {
+                for (unsigned j = node.offset; j < node.offset + node.count; ++j) {
+                    const Bounds &shape = bounds[this->indices[j]];
+                    const float_trace_t
+                        min[3] = { NarrowDown(shape.min[0]), NarrowDown(shape.min[1]), NarrowDown(shape.min[2]) },
+                        max[3] = { NarrowUp(shape.max[0]), NarrowUp(shape.max[1]), NarrowUp(shape.max[2]) };
+                    if (!holds(node, min, max)) {
+                        return false;
+                    }
+                }
+            } else if (!holds(node, this->nodes[node.offset].min, this->nodes[node.offset].max) || !holds(node, this->nodes[node.offset + 1].min, this->nodes[node.offset + 1].max)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+};
@@ -0,0 +1,309 @@
+#ifndef SRC_BVH_H_
+#define SRC_BVH_H_
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include "graphics/graphics.h"
+#include "precision.h"
+
+namespace RayTrace {
+
+    struct Bounds {
+
+        float_max_t min[3], max[3];
+
+        Bounds () {
+            std::fill(this->min, this->min + 3, std::numeric_limits<float_max_t>::max());
+            std::fill(this->max, this->max + 3, -std::numeric_limits<float_max_t>::max());
+        }
+
+        Bounds (const Geometry::Vec<3> &corner_1, const Geometry::Vec<3> &corner_2) {
+            for (unsigned i = 0; i < 3; ++i) {
+                this->min[i] = std::min(corner_1[i], corner_2[i]);
+                this->max[i] = std::max(corner_1[i], corner_2[i]);
+            }
+        }
+
+        static Bounds infinite () {
+            Bounds bounds;
+            std::swap(bounds.min, bounds.max);
+            return bounds;
+        }
+
+        inline bool isEmpty () const {
+            return this->min[0] > this->max[0] || this->min[1] > this->max[1] || this->min[2] > this->max[2];
+        }
+
+        inline bool isFinite () const {
+            for (unsigned i = 0; i < 3; ++i) {
+                if (this->min[i] <= -std::numeric_limits<float_max_t>::max() || this->max[i] >= std::numeric_limits<float_max_t>::max()) {
+                    return false;
+                }
+            }
+            return !this->isEmpty();
+        }
+
+        inline void extend (const Bounds &other) {
+            for (unsigned i = 0; i < 3; ++i) {
+                this->min[i] = std::min(this->min[i], other.min[i]);
+                this->max[i] = std::max(this->max[i], other.max[i]);
+            }
+        }
+
+        inline void clip (const Bounds &other) {
+            for (unsigned i = 0; i < 3; ++i) {
+                this->min[i] = std::max(this->min[i], other.min[i]);
+                this->max[i] = std::min(this->max[i], other.max[i]);
+            }
+        }
+
+        inline float_max_t centroid (unsigned axis) const { return (this->min[axis] + this->max[axis]) * 0.5; }
+
+        inline float_max_t radius () const {
+            const float_max_t
+                dx = this->max[0] - this->min[0],
+                dy = this->max[1] - this->min[1],
+                dz = this->max[2] - this->min[2];
+            return std::sqrt(dx * dx + dy * dy + dz * dz) * 0.5;
+        }
+
+        inline float_max_t area () const {
+            if (this->isEmpty()) {
+                return 0.0;
+            }
+            const float_max_t
+                dx = this->max[0] - this->min[0],
+                dy = this->max[1] - this->min[1],
+                dz = this->max[2] - this->min[2];
+            return 2.0 * (dx * dy + dy * dz + dz * dx);
+        }
+    };
+
+    class BVH {
+
+    public:
+
+        struct Node {
+            // Rounded outwards from the bounds they were built from
+            float_trace_t min[3], max[3];
+            // Leaves reference indices [offset, offset + count), inner nodes (count == 0) have children offset and offset + 1
+            unsigned offset, count, axis;
+        };
+
+        // Slab distances are each a few roundings off, so nodes are entered when the ray misses them by less than that
+        static constexpr float_trace_t SLACK = 1.0 + 4.0 * std::numeric_limits<float_trace_t>::epsilon();
+
+        struct Ray {
+
+            float_trace_t origin[3], direction[3], inverse[3];
+            bool negative[3];
+
+            // Left unset, for arrays of rays filled in later
+            Ray () {}
+
+            Ray (const Geometry::Line &line) {
+                const Geometry::Vec<3> &origin = line.at(0.0), &direction = line.getDirection();
+                for (unsigned i = 0; i < 3; ++i) {
+                    const float_trace_t d = std::abs(direction[i]) > 1e-12 ? Narrow(direction[i]) : std::copysign(float_trace_t(1e-12), direction[i]);
+                    this->origin[i] = Narrow(origin[i]);
+                    this->direction[i] = Narrow(direction[i]);
+                    this->inverse[i] = 1.0 / d;
+                    this->negative[i] = d < 0.0;
+                }
+            }
+
+            inline bool hits (const Node &node, float_max_t distance) const {
+                float_trace_t t_near = 0.0, t_far = Narrow(distance);
+                for (unsigned i = 0; i < 3; ++i) {
+                    float_trace_t
+                        t_0 = (node.min[i] - this->origin[i]) * this->inverse[i],
+                        t_1 = (node.max[i] - this->origin[i]) * this->inverse[i];
+                    if (this->negative[i]) {
+                        std::swap(t_0, t_1);
+                    }
+                    t_near = std::max(t_near, t_0);
+                    t_far = std::min(t_far, t_1 * SLACK);
+                }
+                return t_near <= t_far;
+            }
+
+            // Whether the whole line, behind the origin as well, passes through bounds
+            inline bool crosses (const Bounds &bounds) const {
+                float_max_t t_near = -std::numeric_limits<float_max_t>::infinity(), t_far = std::numeric_limits<float_max_t>::infinity();
+                for (unsigned i = 0; i < 3; ++i) {
+                    float_max_t
+                        t_0 = (bounds.min[i] - this->origin[i]) * this->inverse[i],
+                        t_1 = (bounds.max[i] - this->origin[i]) * this->inverse[i];
+                    if (this->negative[i]) {
+                        std::swap(t_0, t_1);
+                    }
+                    t_near = std::max(t_near, t_0);
+                    t_far = std::min(t_far, t_1);
+                }
+                return t_near <= t_far;
+            }
+        };
+
+        static constexpr unsigned PACKET_SIZE = 4;
+
+        // Bundle of coherent rays stored one coordinate at a time, so every lane loop maps onto vector registers
+        struct Packet {
+
+            float_trace_t origin[3][PACKET_SIZE], direction[3][PACKET_SIZE], inverse[3][PACKET_SIZE];
+            bool active[PACKET_SIZE];
+
+            Packet (const Geometry::Line *lines, unsigned count) {
+                for (unsigned lane = 0; lane < PACKET_SIZE; ++lane) {
+                    const Geometry::Line &line = lines[std::min(lane, count - 1)];
+                    const Geometry::Vec<3> &origin = line.at(0.0), &direction = line.getDirection();
+                    for (unsigned i = 0; i < 3; ++i) {
+                        const float_trace_t d = std::abs(direction[i]) > 1e-12 ? Narrow(direction[i]) : std::copysign(float_trace_t(1e-12), direction[i]);
+                        this->origin[i][lane] = Narrow(origin[i]);
+                        this->direction[i][lane] = Narrow(direction[i]);
+                        this->inverse[i][lane] = 1.0 / d;
+                    }
+                    this->active[lane] = lane < count;
+                }
+            }
+
+            inline bool hits (const Node &node, const float_max_t distance[PACKET_SIZE]) const {
+                bool any = false;
+                #pragma omp simd reduction(||:any)
+                for (unsigned lane = 0; lane < PACKET_SIZE; ++lane) {
+                    float_trace_t t_near = 0.0, t_far = Narrow(distance[lane]);
+                    for (unsigned i = 0; i < 3; ++i) {
+                        const float_trace_t
+                            t_0 = (node.min[i] - this->origin[i][lane]) * this->inverse[i][lane],
+                            t_1 = (node.max[i] - this->origin[i][lane]) * this->inverse[i][lane];
+                        t_near = std::max(t_near, std::min(t_0, t_1));
+                        t_far = std::min(t_far, std::max(t_0, t_1) * SLACK);
+                    }
+                    any = any || (this->active[lane] && t_near <= t_far);
+                }
+                return any;
+            }
+        };
+
+    private:
+
+        static constexpr unsigned
+            BINS = 16,
+            PARALLEL_THRESHOLD = 4096,
+            STACK_SIZE = 64;
+
+        std::vector<Node> nodes;
+        std::vector<unsigned> indices;
+
+    public:
+
+        static constexpr unsigned MAX_LEAF = 4;
+
+        BVH () {}
+        BVH (const std::vector<Bounds> &bounds) { this->build(bounds); }
+        BVH (std::vector<Node> nodes, std::vector<unsigned> indices) : nodes(std::move(nodes)), indices(std::move(indices)) {}
+
+        // Leaves hold at most max_leaf shapes, and the cost model assumes batch of them are intersected at once
+        void build (const std::vector<Bounds> &bounds, unsigned max_leaf = MAX_LEAF, unsigned batch = 1);
+
+        inline bool empty () const { return this->nodes.empty(); }
+
+        // Whether the hierarchy, as read from elsewhere, is a well formed one whose nodes hold the given bounds
+        bool fits (const std::vector<Bounds> &bounds) const;
+        inline const std::vector<unsigned> &getIndices () const { return this->indices; }
+        inline const std::vector<Node> &getNodes () const { return this->nodes; }
+
+        // Visits every leaf crossed by the ray before distance as the range [offset, offset + count), nearest nodes first.
+        // The visitor may shrink distance to cull the remaining nodes, or return true to stop right away.
+        template <typename Visitor>
+        bool traverseLeaves (const Ray &ray, const float_max_t &distance, Visitor visit) const {
+
+            if (this->nodes.empty()) {
+                return false;
+            }
+
+            unsigned stack[STACK_SIZE], top = 0, current = 0;
+
+            while (true) {
+
+                const Node &node = this->nodes[current];
+
+                if (ray.hits(node, distance)) {
+                    if (node.count > 0) {
+                        if (visit(node.offset, node.count)) {
+                            return true;
+                        }
+                    } else {
+                        if (ray.negative[node.axis]) {
+                            stack[top++] = node.offset;
+                            current = node.offset + 1;
+                        } else {
+                            stack[top++] = node.offset + 1;
+                            current = node.offset;
+                        }
+                        continue;
+                    }
+                }
+
+                if (top == 0) {
+                    return false;
+                }
+                current = stack[--top];
+            }
+        }
+
+        // Same walk, one primitive at a time
+        template <typename Visitor>
+        bool traverse (const Ray &ray, const float_max_t &distance, Visitor visit) const {
+            return this->traverseLeaves(ray, distance, [ &visit ] (unsigned offset, unsigned count) {
+                for (unsigned i = offset, end = offset + count; i < end; ++i) {
+                    if (visit(i)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        // Leaf walk for a whole packet, entering every node that at least one lane hits.
+        // The order follows the direction of the first lane, which is close enough for coherent rays.
+        template <typename Visitor>
+        void traverseLeaves (const Packet &packet, const float_max_t distance[PACKET_SIZE], Visitor visit) const {
+
+            if (this->nodes.empty()) {
+                return;
+            }
+
+            unsigned stack[STACK_SIZE], top = 0, current = 0;
+
+            while (true) {
+
+                const Node &node = this->nodes[current];
+
+                if (packet.hits(node, distance)) {
+                    if (node.count > 0) {
+                        visit(node.offset, node.count);
+                    } else {
+                        if (packet.direction[node.axis][0] < 0.0) {
+                            stack[top++] = node.offset;
+                            current = node.offset + 1;
+                        } else {
+                            stack[top++] = node.offset + 1;
+                            current = node.offset;
+                        }
+                        continue;
+                    }
+                }
+
+                if (top == 0) {
+                    return;
+                }
+                current = stack[--top];
+            }
+        }
+    };
+
+};
+
+#endif
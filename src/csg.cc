@@ -0,0 +1,122 @@
+#include "csg.h"
+
+namespace RayTrace {
+
+    Union::Union (const std::vector<Member> &members) : ::Shape::Shape(nullptr, nullptr) {
+        for (const Member &member : members) {
+            const Union *nested = dynamic_cast<const Union *>(member.shape);
+            if (nested != nullptr) {
+                this->members.insert(this->members.end(), nested->members.begin(), nested->members.end());
+            } else {
+                this->members.push_back(member);
+            }
+            this->bounds.extend(member.bounds);
+        }
+    }
+
+    bool Union::intersectLine (
+        const Geometry::Line &line,
+        float_max_t &t_min,
+        float_max_t &t_max,
+        bool get_info,
+        Geometry::Vec<3> &normal_min,
+        Geometry::Vec<3> &normal_max,
+        bool &inside_min,
+        bool &inside_max,
+        Pigment::Color &color_min,
+        Pigment::Color &color_max,
+        Light::Material &material_min,
+        Light::Material &material_max
+    ) const {
+
+        const BVH::Ray ray(line);
+
+        if (!ray.crosses(this->bounds)) {
+            return false;
+        }
+
+        bool found = false;
+        float_max_t member_min, member_max;
+        Geometry::Vec<3> member_normal_min, member_normal_max;
+        bool member_inside_min, member_inside_max;
+        Pigment::Color member_color_min, member_color_max;
+        Light::Material member_material_min, member_material_max;
+
+        for (const Member &member : this->members) {
+
+            if (!ray.crosses(member.bounds) || !member.shape->intersectLine(
+                line, member_min, member_max, get_info, member_normal_min, member_normal_max, member_inside_min, member_inside_max,
+                member_color_min, member_color_max, member_material_min, member_material_max
+            )) {
+                continue;
+            }
+
+            if (!found || member_min < t_min) {
+                t_min = member_min;
+                if (get_info) {
+                    normal_min = member_normal_min;
+                    inside_min = member_inside_min;
+                    color_min = member_color_min;
+                    material_min = member_material_min;
+                }
+            }
+
+            if (!found || member_max > t_max) {
+                t_max = member_max;
+                if (get_info) {
+                    normal_max = member_normal_max;
+                    inside_max = member_inside_max;
+                    color_max = member_color_max;
+                    material_max = member_material_max;
+                }
+            }
+
+            found = true;
+        }
+
+        return found;
+    }
+
+    BoundedCSG::BoundedCSG (
+        const ::Shape::CSGTree *tree,
+        const ::Shape::Shape *first,
+        ::Shape::CSGTree::Type operation,
+        const Bounds &bounds,
+        const Bounds &second_bounds
+    ) :
+        ::Shape::Shape(nullptr, nullptr),
+        tree(tree),
+        first(first),
+        operation(operation),
+        bounds(bounds),
+        second_bounds(second_bounds) {}
+
+    bool BoundedCSG::intersectLine (
+        const Geometry::Line &line,
+        float_max_t &t_min,
+        float_max_t &t_max,
+        bool get_info,
+        Geometry::Vec<3> &normal_min,
+        Geometry::Vec<3> &normal_max,
+        bool &inside_min,
+        bool &inside_max,
+        Pigment::Color &color_min,
+        Pigment::Color &color_max,
+        Light::Material &material_min,
+        Light::Material &material_max
+    ) const {
+
+        const BVH::Ray ray(line);
+
+        if (!ray.crosses(this->bounds)) {
+            return false;
+        }
+
+        const ::Shape::Shape *shape = this->operation == ::Shape::CSGTree::SUBTRACTION && !ray.crosses(this->second_bounds) ? this->first : this->tree;
+
+        return shape->intersectLine(
+            line, t_min, t_max, get_info, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max
+        );
+    }
+
+};
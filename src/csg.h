@@ -0,0 +1,88 @@
+#ifndef SRC_CSG_H_
+#define SRC_CSG_H_
+
+#include <vector>
+#include "graphics/graphics.h"
+#include "bvh.h"
+
+namespace RayTrace {
+
+    // Union of any number of shapes, spanning from the nearest point where the line enters one of them to the
+    // farthest where it leaves one. Members whose bounds the line misses are never asked, and the shape that comes
+    // first wins ties between members.
+    class Union : public Shape::Shape {
+
+    public:
+
+        struct Member {
+            const ::Shape::Shape *shape;
+            Bounds bounds;
+        };
+
+    private:
+
+        std::vector<Member> members;
+        Bounds bounds;
+
+    public:
+
+        // Members that are unions themselves have their own members taken in their place
+        Union (const std::vector<Member> &members);
+
+        inline const std::vector<Member> &getMembers () const { return this->members; }
+
+        bool intersectLine (
+            const Geometry::Line &line,
+            float_max_t &t_min,
+            float_max_t &t_max,
+            bool get_info,
+            Geometry::Vec<3> &normal_min,
+            Geometry::Vec<3> &normal_max,
+            bool &inside_min,
+            bool &inside_max,
+            Pigment::Color &color_min,
+            Pigment::Color &color_max,
+            Light::Material &material_min,
+            Light::Material &material_max
+        ) const override;
+    };
+
+    // Intersection or subtraction of the library, only asked when the line crosses the bounds of the result. A
+    // subtraction whose second shape is missed is just its first one.
+    class BoundedCSG : public Shape::Shape {
+
+        const ::Shape::CSGTree *tree;
+        const ::Shape::Shape *first;
+        ::Shape::CSGTree::Type operation;
+        Bounds bounds, second_bounds;
+
+    public:
+
+        // tree is the library tree of first and second
+        BoundedCSG (
+            const ::Shape::CSGTree *tree,
+            const ::Shape::Shape *first,
+            ::Shape::CSGTree::Type operation,
+            const Bounds &bounds,
+            const Bounds &second_bounds
+        );
+
+        bool intersectLine (
+            const Geometry::Line &line,
+            float_max_t &t_min,
+            float_max_t &t_max,
+            bool get_info,
+            Geometry::Vec<3> &normal_min,
+            Geometry::Vec<3> &normal_max,
+            bool &inside_min,
+            bool &inside_max,
+            Pigment::Color &color_min,
+            Pigment::Color &color_max,
+            Light::Material &material_min,
+            Light::Material &material_max
+        ) const override;
+    };
+
+};
+
+#endif
@@ -1,4 +1,6 @@
+#include <cstring>
 #include "filemanip.h"
+#include "raytrace.h"
 
 namespace FileManip {
 
@@ -14,7 +16,7 @@ namespace FileManip {
         return line;
     }
 
-    void readLights (std::istream &input, Pigment::Color &ambient, std::vector<Light::Light *> &lights) {
+    void readLights (SceneStream &input, RayTrace::Arena &arena, Pigment::Color &ambient, std::vector<Light::Light *> &lights) {
 
         unsigned num_lights;
         Geometry::Vec<3> ignore, position;
@@ -22,114 +24,86 @@ namespace FileManip {
         float_max_t constant, linear, quadratic;
 
         ambient[3] = 1.0;
-        input >> num_lights >> ignore >> ambient[0] >> ambient[1] >> ambient[2] >> ignore;
+        input.count(num_lights);
+
+        // The first light only gives the ambient color
+        if (num_lights == 0) {
+            input.error("the ambient light is missing");
+            return;
+        }
+
+        input >> ignore >> ambient[0] >> ambient[1] >> ambient[2] >> ignore;
 
         lights.resize(--num_lights);
         for (unsigned i = 0; i < num_lights; ++i) {
             input >> position >> color[0] >> color[1] >> color[2] >> constant >> linear >> quadratic;
-            lights[i] = new Light::Light(position, color, constant, linear, quadratic);
+            lights[i] = arena.make<Light::Light>(position, color, constant, linear, quadratic);
         }
     }
 
-    Pigment::Solid *makeSolid (std::istream &input) {
+    Pigment::Solid *makeSolid (SceneStream &input, RayTrace::Arena &arena) {
 
         Pigment::Color solid_color(0.0, 0.0, 0.0, 1.0);
         input >> solid_color[0] >> solid_color[1] >> solid_color[2];
 
-        return new Pigment::Solid(solid_color);
+        return arena.make<Pigment::Solid>(solid_color);
     }
 
-    Pigment::Procedural *makeChecker (std::istream &input) {
+    RayTrace::Checker *makeChecker (SceneStream &input, RayTrace::Arena &arena) {
 
-        Pigment::Color avg_checker, checker_color_1(0.0, 0.0, 0.0), checker_color_2(0.0, 0.0, 0.0);
+        Pigment::Color checker_color_1(0.0, 0.0, 0.0), checker_color_2(0.0, 0.0, 0.0);
         float_max_t checker_size;
 
         input >> checker_color_1[0] >> checker_color_1[1] >> checker_color_1[2]
               >> checker_color_2[0] >> checker_color_2[1] >> checker_color_2[2]
               >> checker_size;
 
-        checker_size *= 2.0;
-
-        avg_checker = Pigment::Color((checker_color_1 + checker_color_2) * 0.5);
-
-        return new Pigment::Procedural([ checker_color_1, checker_color_2, avg_checker ] (const Geometry::Vec<2> &param) {
-
-            const float_max_t
-                s = Geometry::fract(param[0]),
-                t = Geometry::fract(param[1]);
-
-            if (Geometry::closeToZero(s) || Geometry::closeTo(s, 0.5) || Geometry::closeTo(s, 1.0) ||
-                Geometry::closeToZero(t) || Geometry::closeTo(t, 0.5) || Geometry::closeTo(t, 1.0)) {
-                return avg_checker;
-            }
-
-            const bool right = std::round(s) > 0.5, top = std::round(t) > 0.5;
-
-            if ((top && right) || !(top || right)) {
-                return checker_color_1;
-            }
-
-            return checker_color_2;
-
-        }, checker_size, checker_size);
+        return arena.make<RayTrace::Checker>(checker_color_1, checker_color_2, checker_size * 2.0);
     }
 
-
-    // return { (1 + std::sin(param[0])) * 0.5, (1.0 + std::sin(param[0])) * 0.5, (1 + std::sin(param[0])) * 0.5 };
-    Pigment::Procedural *makeMoisture (std::istream &input) {
+    RayTrace::Moisture *makeMoisture (SceneStream &input, RayTrace::Arena &arena) {
 
         Pigment::Color
             moisture_color_1(0.0, 0.0, 0.0),
             moisture_color_2(0.0, 0.0, 0.0);
 
-        Pigment::PerlinNoise noise;
         unsigned seed;
         float_max_t moisture_size;
 
         input >> seed >> moisture_color_1[0] >> moisture_color_1[1] >> moisture_color_1[2]
               >> moisture_color_2[0] >> moisture_color_2[1] >> moisture_color_2[2] >> moisture_size;
 
-        noise.shuffle(seed);
-
-        return new Pigment::Procedural([ moisture_color_1, moisture_color_2, noise ] (const Geometry::Vec<2> &param) mutable -> Pigment::Color {
-
-            float_max_t
-                s = std::fmod(param[0], 500.0) + 500.0,
-                t = std::fmod(param[1], 500.0) + 500.0,
-                value = (1.0 + std::sin((s + noise.at(s * 5.0, t * 5.0, 0.0) * 0.5) * 50.0)) * 0.5;
-
-            return value * moisture_color_1 + (-value + 1.0) * moisture_color_2;
-
-        }, moisture_size, moisture_size);
+        return arena.make<RayTrace::Moisture>(moisture_color_1, moisture_color_2, moisture_size, seed);
     }
 
-    Pigment::TexMap<Pigment::Bitmap> *makeTexMapBitmap (std::istream &input, const std::string &texture_dir) {
+    RayTrace::MipTexMap *makeTexMapBitmap (SceneStream &input, RayTrace::Arena &arena, const std::string &texture_dir) {
         std::string bitmap;
         Geometry::Vec<4> P0, P1;
 
         input >> bitmap >> P0 >> P1;
 
-        return new Pigment::TexMap<Pigment::Bitmap>(P0, P1, texture_dir + bitmap);
+        return arena.make<RayTrace::MipTexMap>(P0, P1, texture_dir + bitmap);
     }
 
-    Pigment::Bitmap *makeBitmap (std::istream &input, const std::string &texture_dir) {
+    RayTrace::MipBitmap *makeBitmap (SceneStream &input, RayTrace::Arena &arena, const std::string &texture_dir) {
         std::string bitmap;
         float_max_t width, height;
 
         input >> bitmap >> width >> height;
 
-        return new Pigment::Bitmap(texture_dir + bitmap, width, height);
+        return arena.make<RayTrace::MipBitmap>(texture_dir + bitmap, width, height);
     }
 
     void readPigments (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::string &texture_dir,
         std::vector<Pigment::Texture *> &pigments
     ) {
 
         unsigned num_pigments;
 
-        input >> num_pigments;
+        input.count(num_pigments);
         pigments.resize(num_pigments);
 
         for (unsigned i = 0; i < num_pigments; ++i) {
@@ -139,61 +113,75 @@ namespace FileManip {
 
             if (pigment_type == "solid") {
 
-                pigments[i] = makeSolid(input);
+                pigments[i] = makeSolid(input, arena);
 
             } else if (pigment_type == "checker") {
 
-                pigments[i] = makeChecker(input);
+                pigments[i] = makeChecker(input, arena);
 
             } else if (pigment_type == "moisture") {
 
-                pigments[i] = makeMoisture(input);
+                pigments[i] = makeMoisture(input, arena);
 
             } else if (pigment_type == "texmap") {
 
-                pigments[i] = makeTexMapBitmap(input, texture_dir);
+                pigments[i] = makeTexMapBitmap(input, arena, texture_dir);
 
             } else if (pigment_type == "bitmap") {
 
-                pigments[i] = makeBitmap(input, texture_dir);
+                pigments[i] = makeBitmap(input, arena, texture_dir);
 
             } else {
+                input.error("unknown pigment type '" + pigment_type + "'");
                 pigments[i] = nullptr;
             }
         }
     }
 
     void readSurfaces (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         std::vector<Light::Surface *> &surfaces
     ) {
 
         unsigned num_surfaces;
         float_max_t ambient, diffuse, specular, alpha, reflect, transmit, ior;
 
-        input >> num_surfaces;
+        input.count(num_surfaces);
         surfaces.resize(num_surfaces);
 
         for (unsigned i = 0; i < num_surfaces; ++i) {
             input >> ambient >> diffuse >> specular >> alpha >> reflect >> transmit >> ior;
-            surfaces[i] = new Light::Surface(
-                new Light::Solid<1>(ambient),
-                new Light::Solid<1>(diffuse),
-                new Light::Solid<1>(specular),
-                new Light::Solid<1>(alpha),
-                new Light::Solid<1>(reflect),
-                new Light::Solid<1>(transmit),
-                new Light::Solid<1>(ior),
-                new Light::Solid<3>({ 0.0, 0.0, 0.0 })
-            );
+            // The library surface may delete its channels when destroyed, and those belong to the arena
+            surfaces[i] = arena.place<RayTrace::BakedSurface>(arena, ambient, diffuse, specular, alpha, reflect, transmit, ior);
         }
 
     }
 
+    // Every surface comes from readSurfaces, so all of them are baked
+    void bake (
+        const Pigment::Texture *pigment,
+        const Light::Surface *surface,
+        RayTrace::ShapeInfo &info
+    ) {
+
+        info.baked_material = surface != nullptr;
+        if (info.baked_material) {
+            info.material = static_cast<const RayTrace::BakedSurface *>(surface)->getBaked();
+        }
+
+        info.baked_pigment = dynamic_cast<const Pigment::Solid *>(pigment) != nullptr;
+        if (info.baked_pigment) {
+            info.pigment = pigment->getColor({ 0.0, 0.0 }, { 0.0, 0.0, 0.0 });
+        }
+    }
+
     Shape::Sphere *readSphere (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         Pigment::Texture *pigment,
-        Light::Surface *surface
+        Light::Surface *surface,
+        RayTrace::ShapeInfo &info
     ) {
 
         Geometry::Vec<3> sphere_center;
@@ -201,35 +189,95 @@ namespace FileManip {
 
         input >> sphere_center >> sphere_radius;
 
-        return new Shape::Sphere(sphere_center, sphere_radius, pigment, surface);
+        for (unsigned i = 0; i < 3; ++i) {
+            info.bounds.min[i] = sphere_center[i] - std::abs(sphere_radius);
+            info.bounds.max[i] = sphere_center[i] + std::abs(sphere_radius);
+            info.params[i] = sphere_center[i];
+        }
+
+        info.type = RayTrace::ShapeInfo::SPHERE;
+        info.params[3] = sphere_radius;
+
+        return arena.make<Shape::Sphere>(sphere_center, sphere_radius, pigment, surface);
+    }
+
+    // The inside of a face is where normal . point + d <= 0, so axis aligned faces limit the bounds
+    void limitBounds (const std::array<float_max_t, 4> &face, RayTrace::Bounds &bounds) {
+        for (unsigned axis = 0; axis < 3; ++axis) {
+            const unsigned other_1 = (axis + 1) % 3, other_2 = (axis + 2) % 3;
+            if (face[axis] != 0.0 && face[other_1] == 0.0 && face[other_2] == 0.0) {
+                const float_max_t limit = -face[3] / face[axis];
+                if (face[axis] > 0.0) {
+                    bounds.max[axis] = std::min(bounds.max[axis], limit);
+                } else {
+                    bounds.min[axis] = std::max(bounds.min[axis], limit);
+                }
+            }
+        }
     }
 
     Shape::Polyhedron *readPolyhedron (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         Pigment::Texture *pigment,
-        Light::Surface *surface
+        Light::Surface *surface,
+        RayTrace::ShapeInfo &info
     ) {
 
         unsigned num_faces;
         Geometry::Vec<3> plane_normal;
         float_max_t plane_d;
 
-        input >> num_faces;
+        input.count(num_faces);
 
         std::vector<Geometry::Plane> faces(num_faces);
 
+        info.type = RayTrace::ShapeInfo::POLYHEDRON;
+        info.bounds = RayTrace::Bounds::infinite();
+        info.faces.resize(num_faces);
+
         for (unsigned i = 0; i < num_faces; ++i) {
             input >> plane_normal >> plane_d;
             faces[i] = Geometry::Plane(plane_normal, -plane_d);
+            // Taken back from the plane, so that shading from them gives the very normal the library would
+            const Geometry::Vec<3> &normal = faces[i].getNormal();
+            info.faces[i] = { normal[0], normal[1], normal[2], -faces[i].getDistance() };
+            limitBounds(info.faces[i], info.bounds);
         }
 
-        return new Shape::Polyhedron(faces, pigment, surface);
+        return arena.make<Shape::Polyhedron>(faces, pigment, surface);
+    }
+
+    void describeCylinder (
+        const Geometry::Vec<3> &bottom,
+        const Geometry::Vec<3> &top,
+        float_max_t radius,
+        RayTrace::ShapeInfo &info
+    ) {
+
+        const Geometry::Vec<3> axis = top - bottom;
+        const float_max_t length = axis.length();
+
+        for (unsigned i = 0; i < 3; ++i) {
+            const float_max_t
+                cosine = length > 0.0 ? axis[i] / length : 0.0,
+                extent = std::abs(radius) * std::sqrt(std::max(0.0, 1.0 - cosine * cosine));
+            info.bounds.min[i] = std::min(bottom[i], top[i]) - extent;
+            info.bounds.max[i] = std::max(bottom[i], top[i]) + extent;
+            info.params[i] = bottom[i];
+            info.params[i + 3] = top[i];
+        }
+
+        info.type = length > 0.0 ? RayTrace::ShapeInfo::CYLINDER : RayTrace::ShapeInfo::GENERIC;
+        info.params[6] = radius;
     }
 
     Shape::Cylinder *readCylinder (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         Pigment::Texture *pigment,
-        Light::Surface *surface
+        Light::Surface *surface,
+        RayTrace::ShapeInfo &info
     ) {
 
         Geometry::Vec<3> cylinder_bottom, cylinder_top;
@@ -237,32 +285,95 @@ namespace FileManip {
 
         input >> cylinder_bottom >> cylinder_top >> cylinder_radius;
 
-        return new Shape::Cylinder(cylinder_bottom, cylinder_top, cylinder_radius, pigment, surface);
+        describeCylinder(cylinder_bottom, cylinder_top, cylinder_radius, info);
+
+        return arena.make<Shape::Cylinder>(cylinder_bottom, cylinder_top, cylinder_radius, pigment, surface);
     }
 
     Shape::Box *readBox (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         Pigment::Texture *pigment,
-        Light::Surface *surface
+        Light::Surface *surface,
+        RayTrace::ShapeInfo &info
     ) {
 
         Geometry::Vec<3> box_min, box_max;
 
         input >> box_min >> box_max;
 
-        return new Shape::Box(box_min, box_max, pigment, surface);
+        info.type = RayTrace::ShapeInfo::BOX;
+        info.bounds = RayTrace::Bounds(box_min, box_max);
+        std::copy(info.bounds.min, info.bounds.min + 3, info.params);
+        std::copy(info.bounds.max, info.bounds.max + 3, info.params + 3);
+
+        return arena.make<Shape::Box>(box_min, box_max, pigment, surface);
     }
 
-    Shape::CSGTree *readCSGTree (
-        std::istream &input,
+    RayTrace::Mesh *readMesh (
+        SceneStream &input,
+        RayTrace::Arena &arena,
+        Pigment::Texture *pigment,
+        Light::Surface *surface,
+        RayTrace::ShapeInfo &info
+    ) {
+
+        std::string path, error;
+        std::vector<RayTrace::float_trace_t> vertices;
+        std::vector<float_max_t> coordinates;
+        std::vector<std::uint32_t> triangles;
+
+        input >> path;
+
+        if (!input.good()) {
+            return nullptr;
+        }
+
+        // Compiled scenes hold the mesh itself, so they load without the file, wherever they are run from
+        if (input.getMode() != SceneStream::COMPILED && !loadMesh(path, vertices, coordinates, triangles, error)) {
+            input.error("cannot load the mesh '" + path + "': " + error);
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        input.array<double>(vertices).array<double>(coordinates).array<std::uint32_t>(triangles);
+
+        if (!input.good()) {
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        RayTrace::Mesh *mesh = arena.make<RayTrace::Mesh>(std::move(vertices), std::move(coordinates), std::move(triangles), pigment, surface);
+
+        info.type = RayTrace::ShapeInfo::MESH;
+        info.bounds = mesh->getBounds();
+
+        return mesh;
+    }
+
+    // Every point of a CSG tree comes from one of its shapes, so a material all of them share is the material of the tree
+    void combineInfo (const RayTrace::ShapeInfo &other, RayTrace::ShapeInfo &info) {
+        info.type = RayTrace::ShapeInfo::GENERIC;
+        info.baked_material = info.baked_material && other.baked_material && info.material == other.material;
+        info.baked_pigment = info.prototype = false;
+        info.instance = info.instance || other.instance;
+        info.faces.clear();
+    }
+
+    Shape::Shape *readCSGTree (
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     ) {
 
         std::string type;
         Shape::CSGTree::Type operation;
         Shape::Shape *shape_first, *shape_second;
+        RayTrace::ShapeInfo info_second;
 
         input >> type;
 
@@ -273,43 +384,84 @@ namespace FileManip {
         } else if (type == "subtraction") {
             operation = Shape::CSGTree::SUBTRACTION;
         } else {
+            input.error("unknown CSG operation '" + type + "'");
+            info.bounds = RayTrace::Bounds();
             return nullptr;
         }
 
-        shape_first = readShape(input, shapes, pigments, surfaces);
-        shape_second = readShape(input, shapes, pigments, surfaces);
+        shape_first = readShape(input, arena, shapes, infos, pigments, surfaces, info);
+        shape_second = readShape(input, arena, shapes, infos, pigments, surfaces, info_second);
 
-        return new Shape::CSGTree(shape_first, operation, shape_second);
-    }
+        if (!input.good()) {
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
 
-    Shape::Shape *nextUnion (
-        std::istream &input,
-        const std::vector<Shape::Shape *> &shapes,
-        const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces,
-        unsigned size
-    ) {
-        if (size > 1) {
-            return new Shape::CSGTree(readShape(input, shapes, pigments, surfaces), Shape::CSGTree::UNION, nextUnion(input, shapes, pigments, surfaces, size - 1));
+        const RayTrace::Bounds bounds_first = info.bounds;
+
+        combineInfo(info_second, info);
+
+        if (operation == Shape::CSGTree::UNION) {
+            info.bounds.extend(info_second.bounds);
+            return arena.make<RayTrace::Union>(std::vector<RayTrace::Union::Member>({ { shape_first, bounds_first }, { shape_second, info_second.bounds } }));
+        } else if (operation == Shape::CSGTree::INTERSECTION) {
+            info.bounds.clip(info_second.bounds);
         }
-        return readShape(input, shapes, pigments, surfaces);
+
+        // The library tree may delete its shapes when destroyed, and those belong to the arena
+        const Shape::CSGTree *tree = arena.place<Shape::CSGTree>(shape_first, operation, shape_second);
+
+        return arena.make<RayTrace::BoundedCSG>(tree, shape_first, operation, info.bounds, info_second.bounds);
     }
 
     Shape::Shape *readUnion (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     ) {
 
         unsigned size;
+        std::vector<RayTrace::Union::Member> members;
 
-        input >> size;
+        input.count(size);
 
-        return nextUnion(input, shapes, pigments, surfaces, size);
+        if (size == 0) {
+            input.error("a union needs at least one shape");
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        Shape::Shape *shape_first = readShape(input, arena, shapes, infos, pigments, surfaces, info);
+
+        if (size == 1) {
+            return shape_first;
+        }
+
+        members.reserve(size);
+        members.push_back({ shape_first, info.bounds });
+
+        for (unsigned i = 1; i < size && input.good(); ++i) {
+            RayTrace::ShapeInfo info_member;
+            Shape::Shape *shape_member = readShape(input, arena, shapes, infos, pigments, surfaces, info_member);
+            members.push_back({ shape_member, info_member.bounds });
+            combineInfo(info_member, info);
+            info.bounds.extend(info_member.bounds);
+        }
+
+        if (!input.good()) {
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        return arena.make<RayTrace::Union>(members);
     }
 
-    void readTransform (std::istream &input, Shape::Transformed *shape) {
+    // Leaves in transform the map of the next translate, rotate, scale or shear, relative to the origin
+    bool readTransform (SceneStream &input, RayTrace::Affine &transform) {
 
         std::string type;
 
@@ -318,133 +470,435 @@ namespace FileManip {
         if (type == "translate") {
             Geometry::Vec<3> translation;
             input >> translation;
-            shape->translate(translation);
+            transform = RayTrace::Affine::translation(translation);
         } else if (type == "rotate") {
-            Geometry::Quaternion rotation;
+            Geometry::Vec<4> rotation;
             input >> rotation;
-            shape->rotate(rotation);
+            transform = RayTrace::Affine::rotation(rotation);
         } else if (type == "scale") {
             float_max_t sx, sy, sz;
             input >> sx >> sy >> sz;
-            shape->scale(sx, sy, sz);
+            transform = RayTrace::Affine::scaling(sx, sy, sz);
         } else if (type == "shear") {
             float_max_t sxy, sxz, syx, syz, szx, szy;
             input >> sxy >> sxz >> syx >> syz >> szx >> szy;
-            shape->shear(sxy, sxz, syx, syz, szx, szy);
+            transform = RayTrace::Affine::shearing(sxy, sxz, syx, syz, szx, szy);
+        } else {
+            input.error("unknown transform '" + type + "'");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Carries what is known about a shape through transform. Spheres and cylinders moved by a similarity, boxes
+    // scaled along the axes and any polyhedron keep their type, so ShapeSet still intersects them directly.
+    void transformInfo (const RayTrace::Affine &transform, RayTrace::ShapeInfo &info) {
+
+        const float_max_t scale = transform.similarity();
+        const RayTrace::Bounds bounds = transform.apply(info.bounds);
+
+        if (info.type == RayTrace::ShapeInfo::SPHERE && scale > 0.0) {
+
+            const Geometry::Vec<3> center = transform.point({ info.params[0], info.params[1], info.params[2] });
+            const float_max_t radius = scale * std::abs(info.params[3]);
+
+            for (unsigned i = 0; i < 3; ++i) {
+                info.bounds.min[i] = center[i] - radius;
+                info.bounds.max[i] = center[i] + radius;
+                info.params[i] = center[i];
+            }
+            info.params[3] = radius;
+
+        } else if (info.type == RayTrace::ShapeInfo::BOX && transform.diagonal()) {
+
+            info.bounds = RayTrace::Bounds(
+                transform.point({ info.params[0], info.params[1], info.params[2] }),
+                transform.point({ info.params[3], info.params[4], info.params[5] })
+            );
+            std::copy(info.bounds.min, info.bounds.min + 3, info.params);
+            std::copy(info.bounds.max, info.bounds.max + 3, info.params + 3);
+
+        } else if (info.type == RayTrace::ShapeInfo::CYLINDER && scale > 0.0) {
+
+            describeCylinder(
+                transform.point({ info.params[0], info.params[1], info.params[2] }),
+                transform.point({ info.params[3], info.params[4], info.params[5] }),
+                scale * info.params[6],
+                info
+            );
+
+        } else if (info.type == RayTrace::ShapeInfo::POLYHEDRON) {
+
+            RayTrace::Affine inverse;
+            transform.invert(inverse);
+
+            // normal . x + d over the points x = inverse(y) of the world
+            info.bounds = bounds;
+            for (auto &face : info.faces) {
+                const Geometry::Vec<3> normal = inverse.transposed({ face[0], face[1], face[2] });
+                const float_max_t
+                    d = face[0] * inverse.offset[0] + face[1] * inverse.offset[1] + face[2] * inverse.offset[2] + face[3],
+                    length = normal.length();
+                face = { normal[0] / length, normal[1] / length, normal[2] / length, d / length };
+                limitBounds(face, info.bounds);
+            }
+
+        } else {
+            info.type = RayTrace::ShapeInfo::GENERIC;
+            info.bounds = bounds;
+            info.faces.clear();
         }
     }
 
-    Shape::Transformed *readTransformedShape (
-        std::istream &input,
+    Shape::Shape *readTransformedShape (
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     ) {
 
         Geometry::Vec<3> pivot;
         unsigned num_transforms;
-        Shape::Transformed *transformed;
-
-        input >> pivot >> num_transforms;
+        RayTrace::Affine transform, inverse;
+        Shape::Shape *shape;
 
-        transformed = new Shape::Transformed(nullptr, pivot);
+        input >> pivot;
+        input.count(num_transforms);
 
+        // Every transform works around the pivot on the shape as the ones before it left it
         for (unsigned i = 0; i < num_transforms; ++i) {
-            readTransform(input, transformed);
+            RayTrace::Affine next;
+            if (readTransform(input, next)) {
+                transform = next.around(pivot) * transform;
+            }
+        }
+
+        if (input.good() && !transform.invert(inverse)) {
+            input.error("the transforms cannot be undone");
         }
 
-        transformed->setShape(readShape(input, shapes, pigments, surfaces));
+        shape = readShape(input, arena, shapes, infos, pigments, surfaces, info);
+
+        if (!input.good()) {
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        // Transforms move the surface of a shape without changing what it is made of
+        info.prototype = info.instance = false;
+        transformInfo(transform, info);
+
+        // Transforms of transforms are folded into one, the inner one being left as it is for whoever else has it
+        if (const RayTrace::Transformed *nested = dynamic_cast<const RayTrace::Transformed *>(shape)) {
+            return arena.make<RayTrace::Transformed>(nested->getShape(), transform * nested->getTransform());
+        }
 
-        return transformed;
+        return arena.make<RayTrace::Transformed>(shape, transform);
+    }
+
+    Shape::Shape *readInstance (
+        SceneStream &input,
+        const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
+        RayTrace::ShapeInfo &info
+    ) {
+
+        unsigned index;
+
+        input >> index;
+
+        if (index >= shapes.size() || shapes[index] == nullptr) {
+            input.error("shape " + std::to_string(index) + " is not defined before its instance");
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
+
+        info = infos[index];
+        info.prototype = false;
+        info.instance = true;
+
+        return shapes[index];
     }
 
     Shape::Shape *readShape (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     ) {
 
         std::string shape_type;
         unsigned pigment, surface;
 
-        input >> pigment >> surface >> shape_type;
+        input >> pigment;
+        if (pigment >= pigments.size()) {
+            input.error("there is no pigment " + std::to_string(pigment));
+        }
+
+        input >> surface;
+        if (surface >= surfaces.size()) {
+            input.error("there is no surface " + std::to_string(surface));
+        }
+
+        input >> shape_type;
+
+        if (!input.good()) {
+            info.bounds = RayTrace::Bounds();
+            return nullptr;
+        }
 
         if (shape_type == "sphere") {
 
-            Shape::Shape *sphe = readSphere(input, pigments[pigment], surfaces[surface]);
+            bake(pigments[pigment], surfaces[surface], info);
+            Shape::Shape *sphe = readSphere(input, arena, pigments[pigment], surfaces[surface], info);
             return sphe;
 
         } else if (shape_type == "polyhedron") {
 
-            return readPolyhedron(input, pigments[pigment], surfaces[surface]);
+            bake(pigments[pigment], surfaces[surface], info);
+            return readPolyhedron(input, arena, pigments[pigment], surfaces[surface], info);
 
         } else if (shape_type == "cylinder") {
 
-            return readCylinder(input, pigments[pigment], surfaces[surface]);
+            bake(pigments[pigment], surfaces[surface], info);
+            return readCylinder(input, arena, pigments[pigment], surfaces[surface], info);
 
         } else if (shape_type == "box") {
 
-            return readBox(input, pigments[pigment], surfaces[surface]);
+            bake(pigments[pigment], surfaces[surface], info);
+            return readBox(input, arena, pigments[pigment], surfaces[surface], info);
+
+        } else if (shape_type == "mesh") {
+
+            bake(pigments[pigment], surfaces[surface], info);
+            return readMesh(input, arena, pigments[pigment], surfaces[surface], info);
 
         } else if (shape_type == "csg_tree") {
 
-            return readCSGTree(input, shapes, pigments, surfaces);
+            return readCSGTree(input, arena, shapes, infos, pigments, surfaces, info);
 
         } else if (shape_type == "union") {
 
-            return readUnion(input, shapes, pigments, surfaces);
+            return readUnion(input, arena, shapes, infos, pigments, surfaces, info);
 
         } else if (shape_type == "transform") {
 
-            return readTransformedShape(input, shapes, pigments, surfaces);
+            return readTransformedShape(input, arena, shapes, infos, pigments, surfaces, info);
+
+        } else if (shape_type == "instance") {
+
+            if (pigment != 0 || surface != 0) {
+                input.error("an instance keeps the pigment and surface of its shape, so it takes pigment 0 and surface 0");
+                info.bounds = RayTrace::Bounds();
+                return nullptr;
+            }
+            return readInstance(input, shapes, infos, info);
+
+        } else if (shape_type == "prototype") {
+
+            Shape::Shape *prototype = readShape(input, arena, shapes, infos, pigments, surfaces, info);
+            info.prototype = true;
+            return prototype;
 
         }
 
+        input.error("unknown shape type '" + shape_type + "'");
+        info.bounds = RayTrace::Bounds();
+
         return nullptr;
     }
 
     void readShapes (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         std::vector<Shape::Shape *> &shapes,
+        std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
         const std::vector<Light::Surface *> &surfaces
     ) {
 
         unsigned num_shapes;
 
-        input >> num_shapes;
+        input.count(num_shapes);
         shapes.resize(num_shapes);
+        infos.resize(num_shapes);
 
         for (unsigned i = 0; i < num_shapes; ++i) {
-            shapes[i] = readShape(input, shapes, pigments, surfaces);
+            shapes[i] = readShape(input, arena, shapes, infos, pigments, surfaces, infos[i]);
+            if (infos[i].instance && !infos[i].prototype) {
+                input.error("shape " + std::to_string(i) + " places an instance right where its shape already is, without a transform");
+            }
         }
 
     }
 
-    bool readFile (
-        const std::string &name,
-        const std::string &texture_dir,
-        Geometry::Camera &camera,
-        Pigment::Color &ambient,
-        std::vector<Light::Light *> &lights,
-        std::vector<Pigment::Texture *> &pigments,
-        std::vector<Light::Surface *> &surfaces,
-        std::vector<Shape::Shape *> &shapes
-    ) {
-        std::ifstream input(name);
-        if (input.is_open()) {
+    void readScene (SceneStream &input, const std::string &texture_dir, RayTrace::Scene &scene) {
+        scene.camera = readCamera(input);
+        readLights(input, scene.arena, scene.ambient, scene.lights);
+        readPigments(input, scene.arena, texture_dir, scene.pigments);
+        readSurfaces(input, scene.arena, scene.surfaces);
+        readShapes(input, scene.arena, scene.shapes, scene.infos, scene.pigments, scene.surfaces);
+    }
 
-            camera = readCamera(input);
-            readLights(input, ambient, lights);
-            readPigments(input, texture_dir, pigments);
-            readSurfaces(input, surfaces);
-            readShapes(input, shapes, pigments, surfaces);
+    // Bounds checked reads of the parts of a compiled scene outside its value stream
+    struct CompiledReader {
 
-            input.close();
+        const char *data, *end;
+
+        template <typename T>
+        bool has (std::size_t count) const { return static_cast<std::size_t>(this->end - this->data) / sizeof(T) >= count; }
+
+        template <typename T>
+        bool read (T *values, std::size_t count) {
+            if (!this->has<T>(count)) {
+                return false;
+            }
+            // Empty vectors may hand out a null pointer, which memcpy must not get even for no bytes
+            if (count > 0) {
+                std::memcpy(values, this->data, count * sizeof(T));
+            }
+            this->data += count * sizeof(T);
             return true;
         }
+    };
+
+    template <typename T>
+    void write (std::ostream &output, const T *values, std::size_t count) {
+        output.write(reinterpret_cast<const char *>(values), count * sizeof(T));
+    }
+
+    bool fail (std::string *error, const std::string &message) {
+        if (error != nullptr) {
+            *error = message;
+        }
         return false;
     }
 
+    bool readFile (const std::string &name, const std::string &texture_dir, RayTrace::Scene &scene, std::string *error) {
+
+        const MappedFile file(name);
+
+        if (!file.isOpen()) {
+            return fail(error, "cannot open the scene or it is empty");
+        }
+
+        CompiledReader reader = { file.getData(), file.getData() + file.getSize() };
+        char magic[sizeof(COMPILED_MAGIC)];
+        std::uint32_t byte_order, version, float_size, num_hierarchies;
+        std::uint64_t values_size;
+
+        if (!reader.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), COMPILED_MAGIC)) {
+            SceneStream stream(file.getData(), file.getSize());
+            readScene(stream, texture_dir, scene);
+            return stream.good() || fail(error, stream.getError());
+        }
+
+        if (!reader.read(&byte_order, 1) || byte_order != COMPILED_BYTE_ORDER) {
+            return fail(error, "the compiled scene was written with another byte order");
+        }
+
+        if (!reader.read(&version, 1) || version != COMPILED_VERSION) {
+            return fail(error, "the compiled scene is not of version " + std::to_string(COMPILED_VERSION));
+        }
+
+        if (!reader.read(&float_size, 1) || !reader.read(&values_size, 1) ||
+            static_cast<std::uint64_t>(reader.end - reader.data) < values_size) {
+            return fail(error, "the compiled scene ends too early");
+        }
+
+        SceneStream stream(reader.data, values_size, SceneStream::COMPILED);
+        readScene(stream, texture_dir, scene);
+        reader.data += values_size;
+
+        if (!stream.good()) {
+            return fail(error, stream.getError());
+        }
+
+        if (float_size == sizeof(RayTrace::float_trace_t) && reader.read(&num_hierarchies, 1)) {
+            for (unsigned i = 0; i < num_hierarchies; ++i) {
+                std::uint32_t num_nodes, num_indices;
+                if (!reader.read(&num_nodes, 1) || !reader.read(&num_indices, 1) ||
+                    !reader.has<RayTrace::BVH::Node>(num_nodes) || !reader.has<unsigned>(num_indices)) {
+                    scene.hierarchies.clear();
+                    break;
+                }
+                std::vector<RayTrace::BVH::Node> nodes(num_nodes);
+                std::vector<unsigned> indices(num_indices);
+                if (!reader.read(nodes.data(), num_nodes) || !reader.read(indices.data(), num_indices)) {
+                    scene.hierarchies.clear();
+                    break;
+                }
+                scene.hierarchies.emplace_back(std::move(nodes), std::move(indices));
+            }
+        }
+
+        return true;
+    }
+
+    bool compileFile (const std::string &name, const std::string &texture_dir, const std::string &output, std::string *error) {
+
+        const MappedFile file(name);
+        if (!file.isOpen()) {
+            return fail(error, "cannot open the scene or it is empty");
+        }
+
+        RayTrace::Scene scene;
+
+        SceneStream stream(file.getData(), file.getSize(), SceneStream::RECORD);
+        readScene(stream, texture_dir, scene);
+
+        if (!stream.good()) {
+            return fail(error, stream.getError());
+        }
+
+        const std::vector<char> &values = stream.getRecording();
+        const std::vector<RayTrace::BVH> hierarchies = RayTrace::ShapeSet(scene.shapes, scene.infos).getHierarchies();
+        const std::uint32_t
+            byte_order = COMPILED_BYTE_ORDER,
+            version = COMPILED_VERSION,
+            float_size = sizeof(RayTrace::float_trace_t),
+            num_hierarchies = hierarchies.size();
+        const std::uint64_t values_size = values.size();
+
+        std::ofstream compiled(output, std::ios::binary);
+        if (!compiled.is_open()) {
+            return fail(error, "cannot write " + output);
+        }
+
+        write(compiled, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+        write(compiled, &byte_order, 1);
+        write(compiled, &version, 1);
+        write(compiled, &float_size, 1);
+        write(compiled, &values_size, 1);
+        write(compiled, values.data(), values.size());
+        write(compiled, &num_hierarchies, 1);
+
+        for (const RayTrace::BVH &hierarchy : hierarchies) {
+            const std::uint32_t num_nodes = hierarchy.getNodes().size(), num_indices = hierarchy.getIndices().size();
+            write(compiled, &num_nodes, 1);
+            write(compiled, &num_indices, 1);
+            // Copied field by field over zeros, so the padding between them is written as zeros too
+            for (const RayTrace::BVH::Node &node : hierarchy.getNodes()) {
+                RayTrace::BVH::Node clean;
+                std::memset(&clean, 0, sizeof(clean));
+                std::copy(node.min, node.min + 3, clean.min);
+                std::copy(node.max, node.max + 3, clean.max);
+                clean.offset = node.offset;
+                clean.count = node.count;
+                clean.axis = node.axis;
+                write(compiled, &clean, 1);
+            }
+            write(compiled, hierarchy.getIndices().data(), num_indices);
+        }
+
+        return compiled.good() || fail(error, "cannot write " + output);
+    }
+
 };
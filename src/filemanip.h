@@ -5,6 +5,14 @@
 #include <string>
 #include <fstream>
 #include "graphics/graphics.h"
+#include "primitives.h"
+#include "textures.h"
+#include "pigments.h"
+#include "mesh.h"
+#include "transform.h"
+#include "csg.h"
+#include "scene.h"
+#include "scenestream.h"
 
 namespace FileManip {
 
@@ -16,65 +24,101 @@ namespace FileManip {
 
     std::string nextLine (std::istream &in, bool &ok, const char comment = '#');
 
-    inline Geometry::Camera readCamera (std::istream &input) {
+    inline Geometry::Camera readCamera (SceneStream &input) {
         Geometry::Vec<3> position, look_at, up_dir;
         float_max_t fov;
         input >> position >> look_at >> up_dir >> fov;
         return Geometry::Camera(position, look_at, up_dir, fov * Geometry::DEG2RAD);
     }
 
-    void readLights (std::istream &input, Pigment::Color &ambient, std::vector<Light::Light *> &lights);
+    void readLights (SceneStream &input, RayTrace::Arena &arena, Pigment::Color &ambient, std::vector<Light::Light *> &lights);
 
-    void readPigments (std::istream &input, const std::string &texture_dir, std::vector<Pigment::Texture *> &pigments);
-    Pigment::Solid *makeSolid (std::istream &input);
-    Pigment::Procedural *makeChecker (std::istream &input);
-    Pigment::TexMap<Pigment::Bitmap> *makeTexMapBitmap (std::istream &input, const std::string &texture_dir);
-    Pigment::Bitmap *makeBitmap (std::istream &input, const std::string &texture_dir);
+    void readPigments (SceneStream &input, RayTrace::Arena &arena, const std::string &texture_dir, std::vector<Pigment::Texture *> &pigments);
+    Pigment::Solid *makeSolid (SceneStream &input, RayTrace::Arena &arena);
+    RayTrace::Checker *makeChecker (SceneStream &input, RayTrace::Arena &arena);
+    RayTrace::Moisture *makeMoisture (SceneStream &input, RayTrace::Arena &arena);
+    RayTrace::MipTexMap *makeTexMapBitmap (SceneStream &input, RayTrace::Arena &arena, const std::string &texture_dir);
+    RayTrace::MipBitmap *makeBitmap (SceneStream &input, RayTrace::Arena &arena, const std::string &texture_dir);
 
-    void readSurfaces (std::istream &input, std::vector<Light::Surface *> &surfaces);
+    void readSurfaces (SceneStream &input, RayTrace::Arena &arena, std::vector<Light::Surface *> &surfaces);
 
     void readShapes (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         std::vector<Shape::Shape *> &shapes,
+        std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
         const std::vector<Light::Surface *> &surfaces
     );
     Shape::Shape *readShape (
-        std::istream &input,
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
+    );
+    Shape::Sphere *readSphere (SceneStream &input, RayTrace::Arena &arena, Pigment::Texture *pigment, Light::Surface *surface, RayTrace::ShapeInfo &info);
+    Shape::Polyhedron *readPolyhedron (SceneStream &input, RayTrace::Arena &arena, Pigment::Texture *pigment, Light::Surface *surface, RayTrace::ShapeInfo &info);
+    Shape::Cylinder *readCylinder (SceneStream &input, RayTrace::Arena &arena, Pigment::Texture *pigment, Light::Surface *surface, RayTrace::ShapeInfo &info);
+    Shape::Box *readBox (SceneStream &input, RayTrace::Arena &arena, Pigment::Texture *pigment, Light::Surface *surface, RayTrace::ShapeInfo &info);
+    RayTrace::Mesh *readMesh (SceneStream &input, RayTrace::Arena &arena, Pigment::Texture *pigment, Light::Surface *surface, RayTrace::ShapeInfo &info);
+
+    // Reads a Wavefront OBJ or a PLY file, told apart by extension, leaving what went wrong in error when it fails
+    bool loadMesh (
+        const std::string &path,
+        std::vector<RayTrace::float_trace_t> &vertices,
+        std::vector<float_max_t> &coordinates,
+        std::vector<std::uint32_t> &triangles,
+        std::string &error
     );
-    Shape::Sphere *readSphere (std::istream &input, Pigment::Texture *pigment, Light::Surface *surface);
-    Shape::Polyhedron *readPolyhedron (std::istream &input, Pigment::Texture *pigment, Light::Surface *surface);
-    Shape::Cylinder *readCylinder (std::istream &input, Pigment::Texture *pigment, Light::Surface *surface);
-    Shape::Box *readBox (std::istream &input, Pigment::Texture *pigment, Light::Surface *surface);
-    Shape::CSGTree *readCSGTree (
-        std::istream &input,
+    Shape::Shape *readCSGTree (
+        SceneStream &input,
+        RayTrace::Arena &arena,
         const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
         const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     );
 
-    void readTransform (std::istream &input, Shape::Transformed *shape);
-    Shape::Transformed *readTransformedShape (
-        std::istream &input,
+    // Shape defined earlier in the file, shared rather than copied. Its pigment and surface are the ones it was defined
+    // with, so an instance must be written with pigment and surface 0. Instances must also be placed by a transform,
+    // since they would otherwise lie right where their shape does.
+    Shape::Shape *readInstance (
+        SceneStream &input,
         const std::vector<Shape::Shape *> &shapes,
-        const std::vector<Pigment::Texture *> &pigments,
-        const std::vector<Light::Surface *> &surfaces
+        const std::vector<RayTrace::ShapeInfo> &infos,
+        RayTrace::ShapeInfo &info
     );
 
-    bool readFile (
-        const std::string &name,
-        const std::string &texture_dir,
-        Geometry::Camera &camera,
-        Pigment::Color &ambient,
-        std::vector<Light::Light *> &lights,
-        std::vector<Pigment::Texture *> &pigments,
-        std::vector<Light::Surface *> &surfaces,
-        std::vector<Shape::Shape *> &shapes
+    bool readTransform (SceneStream &input, RayTrace::Affine &transform);
+    Shape::Shape *readTransformedShape (
+        SceneStream &input,
+        RayTrace::Arena &arena,
+        const std::vector<Shape::Shape *> &shapes,
+        const std::vector<RayTrace::ShapeInfo> &infos,
+        const std::vector<Pigment::Texture *> &pigments,
+        const std::vector<Light::Surface *> &surfaces,
+        RayTrace::ShapeInfo &info
     );
 
+    // Compiled scenes start with COMPILED_MAGIC, COMPILED_BYTE_ORDER as written by the machine that compiled them, the
+    // format version and sizeof(float_trace_t), followed by the size and bytes of the values recorded by a SceneStream
+    // and by the nodes and indices of the shape hierarchies. Loading one skips parsing text, mesh files included, and
+    // building hierarchies, but the shapes and the primitive stores are still made from the values.
+    constexpr char COMPILED_MAGIC[8] = "RTSCENE";
+    constexpr std::uint32_t COMPILED_BYTE_ORDER = 0x01020304, COMPILED_VERSION = 4;
+
+    // Reads a text or compiled scene into an empty scene, leaving a description of the first problem found in error
+    // when it fails. The hierarchies stored in a compiled scene are kept when they were built with the same
+    // float_trace_t, to be given to RayTrace::ShapeSet, which checks them against the shapes before using them.
+    bool readFile (const std::string &name, const std::string &texture_dir, RayTrace::Scene &scene, std::string *error = nullptr);
+
+    // Reads the text scene at name and writes it, along with its shape hierarchies, as a compiled scene to output
+    bool compileFile (const std::string &name, const std::string &texture_dir, const std::string &output, std::string *error = nullptr);
+
 }
 
 #endif
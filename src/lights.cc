@@ -0,0 +1,56 @@
+#include "lights.h"
+
+namespace RayTrace {
+
+    constexpr float_max_t LightSet::MIN_DIVISOR;
+
+    LightSet::LightSet (const std::vector<Light::Light *> &lights, float_max_t cutoff, unsigned samples) :
+        lights(lights), cutoff(cutoff), samples(samples) {
+
+        if (lights.empty()) {
+            return;
+        }
+
+        std::vector<Bounds> bounds;
+
+        for (const Light::Light *light : lights) {
+            bounds.emplace_back(light->getPosition(), light->getPosition());
+        }
+
+        this->bvh.build(bounds);
+
+        const std::vector<BVH::Node> &nodes = this->bvh.getNodes();
+        const std::vector<unsigned> &indices = this->bvh.getIndices();
+
+        this->summaries.resize(nodes.size());
+
+        // Children always come after their parent, so going backwards summarizes them first
+        for (unsigned i = nodes.size(); i-- > 0;) {
+
+            const BVH::Node &node = nodes[i];
+            Summary &summary = this->summaries[i];
+
+            if (node.count > 0) {
+                summary = summarize(lights[indices[node.offset]]);
+                for (unsigned j = node.offset + 1, end = node.offset + node.count; j < end; ++j) {
+                    const Summary other = summarize(lights[indices[j]]);
+                    summary.intensity = std::max(summary.intensity, other.intensity);
+                    summary.total += other.total;
+                    summary.constant = std::min(summary.constant, other.constant);
+                    summary.linear = std::min(summary.linear, other.linear);
+                    summary.quadratic = std::min(summary.quadratic, other.quadratic);
+                }
+            } else {
+                const Summary &left = this->summaries[node.offset], &right = this->summaries[node.offset + 1];
+                summary = {
+                    std::max(left.intensity, right.intensity),
+                    left.total + right.total,
+                    std::min(left.constant, right.constant),
+                    std::min(left.linear, right.linear),
+                    std::min(left.quadratic, right.quadratic)
+                };
+            }
+        }
+    }
+
+};
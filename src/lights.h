@@ -0,0 +1,199 @@
+#ifndef SRC_LIGHTS_H_
+#define SRC_LIGHTS_H_
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "graphics/graphics.h"
+#include "bvh.h"
+#include "random.h"
+
+namespace RayTrace {
+
+    // Lights of the scene with a BVH over their positions, so that the ones too dim to matter at a point can be
+    // skipped a whole subtree at a time, or a few of them picked by how much they are expected to add
+    class LightSet {
+
+        // Bounds on what the lights below a node can add: brightest channel of the brightest light, brightest channels
+        // summed over all of them, and the smallest attenuation coefficients
+        struct Summary {
+            float_max_t intensity, total, constant, linear, quadratic;
+        };
+
+        static constexpr float_max_t MIN_DIVISOR = 1e-6;
+
+        std::vector<Light::Light *> lights;
+        std::vector<Summary> summaries;
+        BVH bvh;
+
+        // Lights below this estimated contribution are skipped, and when samples is not zero only that many are
+        // picked at every point, with probability proportional to their estimated contribution
+        float_max_t cutoff;
+        unsigned samples;
+
+        static inline float_max_t divisor (const Summary &summary, float_max_t distance) {
+            return summary.constant + distance * summary.linear + distance * distance * summary.quadratic;
+        }
+
+        // Largest share of the light a point at least distance away can receive
+        static inline float_max_t attenuation (const Summary &summary, float_max_t distance) {
+            const float_max_t value = divisor(summary, distance);
+            return value > 0.0 ? 1.0 / value : std::numeric_limits<float_max_t>::infinity();
+        }
+
+        // Distance from point to the box of the node, or to its center when looking for a typical light rather than
+        // the nearest one. The latter never goes below half the box radius, so points inside a cluster still tell
+        // its halves apart.
+        static inline float_max_t distance (const BVH::Node &node, const Geometry::Vec<3> &point, bool center = false) {
+            float_max_t squared = 0.0, radius = 0.0;
+            for (unsigned i = 0; i < 3; ++i) {
+                const float_max_t
+                    gap = center ?
+                        (node.min[i] + node.max[i]) * 0.5 - point[i] :
+                        std::max(std::max(node.min[i] - point[i], point[i] - node.max[i]), 0.0),
+                    side = (node.max[i] - node.min[i]) * 0.5;
+                squared += gap * gap;
+                radius += side * side;
+            }
+            return center ? std::max(std::sqrt(squared), std::sqrt(radius) * 0.5) : std::sqrt(squared);
+        }
+
+        static inline Summary summarize (const Light::Light *light) {
+            const Pigment::Color &color = light->getColor();
+            const float_max_t intensity = std::max(std::max(color[0], color[1]), color[2]);
+            return {
+                intensity,
+                intensity,
+                light->getConstantAttenuation(),
+                light->getLinearAttenuation(),
+                light->getQuadraticAttenuation()
+            };
+        }
+
+    public:
+
+        LightSet (const std::vector<Light::Light *> &lights, float_max_t cutoff = 0.0, unsigned samples = 0);
+
+        inline unsigned size () const { return this->lights.size(); }
+        inline const Light::Light *operator[] (unsigned index) const { return this->lights[index]; }
+
+        // Calls visit(index, weight) for the lights worth shading at point, where reach bounds what the surface
+        // reflects of a light of unit intensity. The light's contribution must be multiplied by weight, which
+        // makes up for the lights left out by sampling. The lights sampled are picked by numbers mixed from key, so
+        // the same key always picks the same lights.
+        template <typename Visitor>
+        void visit (const Geometry::Vec<3> &point, float_max_t reach, std::uint64_t key, Visitor visit) const {
+
+            if (this->lights.empty()) {
+                return;
+            }
+
+            // Nothing to cull or pick, so the lights are visited in scene order as before
+            if (this->cutoff <= 0.0 && this->samples == 0) {
+                for (unsigned i = 0; i < this->lights.size(); ++i) {
+                    visit(i, 1.0);
+                }
+                return;
+            }
+
+            const std::vector<BVH::Node> &nodes = this->bvh.getNodes();
+            const std::vector<unsigned> &indices = this->bvh.getIndices();
+
+            // Whether even the brightest light of a node, at the nearest point of its box, stays below the cutoff
+            auto culled = [ & ] (unsigned node) {
+                const Summary &summary = this->summaries[node];
+                return reach * summary.intensity * attenuation(summary, distance(nodes[node], point)) < this->cutoff;
+            };
+
+            if (this->samples == 0) {
+
+                unsigned stack[64], top = 0;
+                stack[top++] = 0;
+
+                while (top > 0) {
+                    const unsigned current = stack[--top];
+                    if (culled(current)) {
+                        continue;
+                    }
+                    const BVH::Node &node = nodes[current];
+                    if (node.count > 0) {
+                        for (unsigned i = node.offset, end = node.offset + node.count; i < end; ++i) {
+                            const Summary summary = summarize(this->lights[indices[i]]);
+                            const float_max_t light_distance = (this->lights[indices[i]]->getPosition() - point).length();
+                            if (reach * summary.intensity * attenuation(summary, light_distance) >= this->cutoff) {
+                                visit(indices[i], 1.0);
+                            }
+                        }
+                    } else {
+                        stack[top++] = node.offset;
+                        stack[top++] = node.offset + 1;
+                    }
+                }
+                return;
+            }
+
+            // Estimated contribution of a node, all its light at the attenuation of its center. Divisors are kept
+            // away from zero so that no probability below ends up infinite or undefined.
+            auto importance = [ & ] (unsigned node) {
+                const Summary &summary = this->summaries[node];
+                return culled(node) ? 0.0 : summary.total / std::max(divisor(summary, distance(nodes[node], point, true)), MIN_DIVISOR);
+            };
+
+            std::uint64_t draws = 0;
+            auto uniform = [ & ] () { return Uniform(Mix(key, draws++)); };
+
+            for (unsigned sample = 0; sample < this->samples; ++sample) {
+
+                unsigned current = 0;
+                float_max_t probability = 1.0;
+
+                if (importance(current) <= 0.0) {
+                    return;
+                }
+
+                while (nodes[current].count == 0) {
+                    const unsigned first = nodes[current].offset;
+                    const float_max_t
+                        left = importance(first),
+                        right = importance(first + 1),
+                        chance = left + right > 0.0 ? left / (left + right) : 0.5;
+                    if (uniform() < chance) {
+                        current = first;
+                        probability *= chance;
+                    } else {
+                        current = first + 1;
+                        probability *= 1.0 - chance;
+                    }
+                }
+
+                const BVH::Node &leaf = nodes[current];
+
+                float_max_t weights[BVH::MAX_LEAF], total = 0.0;
+
+                for (unsigned i = 0; i < leaf.count; ++i) {
+                    const Light::Light *light = this->lights[indices[leaf.offset + i]];
+                    const Summary summary = summarize(light);
+                    weights[i] = summary.intensity / std::max(divisor(summary, (light->getPosition() - point).length()), MIN_DIVISOR);
+                    total += weights[i];
+                }
+
+                float_max_t pick = uniform() * total;
+                unsigned chosen = 0;
+
+                while (chosen + 1 < leaf.count && pick >= weights[chosen]) {
+                    pick -= weights[chosen++];
+                }
+
+                probability *= total > 0.0 ? weights[chosen] / total : 1.0 / leaf.count;
+
+                if (probability > 0.0) {
+                    visit(indices[leaf.offset + chosen], 1.0 / (probability * this->samples));
+                }
+            }
+        }
+    };
+
+};
+
+#endif
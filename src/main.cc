@@ -1,4 +1,7 @@
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include <numeric>
 #include <chrono>
 #include <fstream>
 #include <iostream>
@@ -8,16 +11,12 @@
 #include "raytrace.h"
 #include "graphics/graphics.h"
 #include "filemanip.h"
+#include "scheduler.h"
 
 int main (int argc, const char *argv[]) {
 
-    Geometry::Camera camera;
-    Pigment::Color ambient;
-    std::vector<Light::Light *> lights;
-    std::vector<Pigment::Texture *> pigments;
-    std::vector<Light::Surface *> surfaces;
-    std::vector<Shape::Shape *> shapes;
-    std::string input_file, texture_dir = "./", output_file = "output.png";
+    RayTrace::Scene scene;
+    std::string input_file, texture_dir = "./", output_file = "output.png", compile_file;
     auto start_time = std::chrono::high_resolution_clock::now();
 
     bool
@@ -27,11 +26,25 @@ int main (int argc, const char *argv[]) {
         use_light_distr = false,
         use_reflect_distr = false,
         use_transmit_distr = false,
+        use_packets = false,
+        use_affinity = false,
+        use_progressive = false,
+        use_adaptive = false,
+        print_stats = false,
+        lazy_textures = false,
         debug_mode = false;
 
     float_max_t
         poisson_distance = 0.3,
-        light_side = 1.0;
+        light_side = 1.0,
+        time_limit = 0.0,
+        target_variance = 0.0,
+        write_seconds = 0.0,
+        adaptive_threshold = 0.05,
+        light_cutoff = 0.0;
+
+    RayTrace::Pruning pruning;
+    RayTrace::ShadowSampling shadow_sampling;
 
     unsigned
         over_samples = 2,
@@ -40,7 +53,12 @@ int main (int argc, const char *argv[]) {
         transmit_rays = 2,
         recursion_levels = 10,
         image_width = 800,
-        image_height = 600;
+        image_height = 600,
+        tile_size = 16,
+        write_passes = 0,
+        light_samples = 0,
+        adaptive_samples = 2,
+        thread_count = omp_get_max_threads();
 
     for (int i = 1; i < argc; ++i) {
 
@@ -103,6 +121,26 @@ int main (int argc, const char *argv[]) {
             if (!value.empty()) {
                 recursion_levels = std::stoi(value);
             }
+        } else if (arg == "--prune") {
+            if (!value.empty()) {
+                pruning.threshold = std::stod(value);
+            }
+        } else if (arg == "--roulette") {
+            pruning.roulette = true;
+        } else if (arg == "--distribute-depth") {
+            if (!value.empty()) {
+                pruning.distribute_depth = std::stoi(value);
+            }
+        } else if (arg == "--adaptive-shadows") {
+            shadow_sampling.adaptive = true;
+        } else if (arg == "--light-cutoff") {
+            if (!value.empty()) {
+                light_cutoff = std::stod(value);
+            }
+        } else if (arg == "--light-samples") {
+            if (!value.empty()) {
+                light_samples = std::stoi(value);
+            }
         } else if (arg == "--texture-dir") {
             if (!value.empty()) {
                 texture_dir = value;
@@ -110,6 +148,53 @@ int main (int argc, const char *argv[]) {
                     texture_dir += '/';
                 }
             }
+        } else if (arg == "--packets") {
+            use_packets = true;
+        } else if (arg == "--tile") {
+            if (!value.empty()) {
+                tile_size = std::max(std::stoi(value), 1);
+            }
+        } else if (arg == "--threads") {
+            if (!value.empty()) {
+                thread_count = std::max(std::stoi(value), 1);
+            }
+        } else if (arg == "--affinity") {
+            use_affinity = true;
+        } else if (arg == "--adaptive") {
+            use_adaptive = true;
+            if (!value.empty()) {
+                adaptive_threshold = std::stod(value);
+            }
+        } else if (arg == "--adaptive-step") {
+            if (!value.empty()) {
+                adaptive_samples = std::max(std::stoi(value), 1);
+            }
+        } else if (arg == "--progressive") {
+            use_progressive = true;
+        } else if (arg == "--time-limit") {
+            if (!value.empty()) {
+                time_limit = std::stod(value);
+                use_progressive = true;
+            }
+        } else if (arg == "--variance") {
+            if (!value.empty()) {
+                target_variance = std::stod(value);
+                use_progressive = true;
+            }
+        } else if (arg == "--write-every") {
+            if (!value.empty()) {
+                write_seconds = std::stod(value);
+            }
+        } else if (arg == "--write-passes") {
+            if (!value.empty()) {
+                write_passes = std::stoi(value);
+            }
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg == "--lazy-textures") {
+            lazy_textures = true;
+        } else if (arg == "--compile-scene") {
+            compile_file = value;
         } else if (arg == "--debug") {
             debug_mode = true;
         } else {
@@ -129,15 +214,61 @@ int main (int argc, const char *argv[]) {
             << "--super-sample=SS  : Square root of ray amount samples to take (anti-aliasing). Disables poisson. Default: SS = 2" << std::endl
             << "--light-rays=LR    : Square root of rays amount to cast in lights, excluding the central (distributed ray-tracing). Default: LR = 4" << std::endl
             << "--light-area=LA    : Area of every light. Enables light rays. Default: LA = 1.0" << std::endl
+            << "--adaptive-shadows : Only cast every light ray where the center and corners of a light disagree. Default: DISABLED" << std::endl
+            << "--light-cutoff=LC  : Skip lights that can add less than LC to the pixel. Default: LC = 0" << std::endl
+            << "--light-samples=LS : Shade every point with LS lights picked by their estimated contribution. Default: all lights" << std::endl
             << "--reflect-rays=RR  : Square root of rays amount to cast after reflection, excluding the central (distributed ray-tracing). Default: RR = 2" << std::endl
             << "--transmit-rays=TR : Square root of rays amount to cast after transmission, excluding the central (distributed ray-tracing). Default: TR = 2" << std::endl
             << "--recurse=REC      : Amount of levels of recursion levels to use. Default: REC = 10" << std::endl
+            << "--prune=PR         : Skip reflections and transmissions adding less than PR to the pixel. Default: PR = 0" << std::endl
+            << "--roulette         : Play Russian roulette with the branches below the pruning threshold instead of skipping them. Default: DISABLED" << std::endl
+            << "--distribute-depth=DD : Bounces after which only central light, reflect and transmit rays are cast. Default: all" << std::endl
             << "--orthogonal       : Use orthogonal projection (may lead to unexpected results). Default: DISABLED" << std::endl
+            << "--packets          : Intersect primary rays in packets of neighbouring pixels. Default: DISABLED" << std::endl
+            << "--tile=TS          : Side in pixels of the square tiles the image is rendered in. Default: TS = 16" << std::endl
+            << "--threads=TH       : Amount of rendering threads. Default: TH = OpenMP maximum" << std::endl
+            << "--affinity         : Bind every rendering thread to its own core. Default: DISABLED" << std::endl
+            << "--adaptive=THR     : Only keep anti-aliasing pixels whose samples or neighbours differ by more than THR. Not with progressive. Default: DISABLED, THR = 0.05" << std::endl
+            << "--adaptive-step=AS : Samples per pixel taken between adaptive checks. Default: AS = 2" << std::endl
+            << "--progressive      : Render one sample per pixel at a time, writing refined images along the way. Default: DISABLED" << std::endl
+            << "--time-limit=SEC   : Seconds since start after which progressive rendering stops. Enables progressive. Default: none" << std::endl
+            << "--variance=VAR     : Average per-pixel variance at which progressive rendering stops. Enables progressive. Default: none" << std::endl
+            << "--write-every=SEC  : Seconds between intermediate images in progressive mode. Default: none" << std::endl
+            << "--write-passes=WP  : Passes between intermediate images in progressive mode. Default: none" << std::endl
+            << "--lazy-textures    : Decode every texture the first time it is sampled instead of while loading the scene. Default: DISABLED" << std::endl
+            << "--compile-scene=OUT : Write the parsed scene values and shape hierarchies to OUT, which -i then loads without parsing text or building hierarchies, and exit. Default: DISABLED" << std::endl
+            << "--stats            : Print rendering counters when done. Default: DISABLED" << std::endl
             << "--debug            : Enable debug mode (prints image line). Default: DISABLED" << std::endl;
         return 1;
     }
 
-    FileManip::readFile(input_file, texture_dir, camera, ambient, lights, pigments, surfaces, shapes);
+    if (use_adaptive && use_progressive) {
+        std::cerr << "--adaptive cannot be combined with --progressive, --time-limit or --variance." << std::endl;
+        return 1;
+    }
+
+    std::string error;
+
+    if (!compile_file.empty()) {
+        if (!FileManip::compileFile(input_file, texture_dir, compile_file, &error)) {
+            std::cerr << "Could not compile '" << input_file << "' into '" << compile_file << "': " << error << "." << std::endl;
+            return 1;
+        }
+        std::cout << "Compiled '" << input_file << "' into '" << compile_file << "'." << std::endl;
+        return 0;
+    }
+
+    if (!FileManip::readFile(input_file, texture_dir, scene, &error)) {
+        std::cerr << "Could not read '" << input_file << "': " << error << "." << std::endl;
+        return 1;
+    }
+
+    if (!lazy_textures) {
+        RayTrace::TextureCache::instance().load();
+    }
+
+    const RayTrace::ShapeSet shape_set(scene.shapes, scene.infos, scene.hierarchies);
+    const RayTrace::LightSet light_set(scene.lights, light_cutoff, light_samples);
 
     constexpr float_max_t
         reflect_side = 1.0,
@@ -157,11 +288,13 @@ int main (int argc, const char *argv[]) {
         inv_image_width = 1.0 / static_cast<float_max_t>(image_width),
         inv_image_height = 1.0 / static_cast<float_max_t>(image_height),
         aspect_ratio = static_cast<float_max_t>(image_width) * inv_image_height,
-        scale = std::tan(camera.getFieldOfView() * 0.5);
+        scale = std::tan(scene.camera.getFieldOfView() * 0.5),
+        // Angle between neighbouring camera rays, orthogonal rays never spreading out
+        spread = use_orthogonal ? 0.0 : 2.0 * scale * inv_image_height;
     const Geometry::Vec<3>
-        eye_pos = camera.getPosition(),
-        up_dir = camera.getUpDirection(),
-        camera_direction = camera.getDirection(),
+        eye_pos = scene.camera.getPosition(),
+        up_dir = scene.camera.getUpDirection(),
+        camera_direction = scene.camera.getDirection(),
         camera_right = camera_direction.cross(up_dir).normalized(),
         camera_up = camera_right.cross(camera_direction),
         camera_offset = eye_pos + camera_direction,
@@ -224,44 +357,374 @@ int main (int argc, const char *argv[]) {
 
     const unsigned size = deviations.size();
 
+    constexpr unsigned PACKET_SIZE = RayTrace::BVH::PACKET_SIZE;
+
+    const unsigned packet_width = use_packets ? PACKET_SIZE : 1;
+
+    // Camera plane offsets of every pixel column and row, one table per sample. The spare last one is for the
+    // samples progressive passes take once the regular ones are done.
     std::vector<std::vector<Geometry::Vec<3>>>
-        pixel_x_cache(image_width, std::vector<Geometry::Vec<3>>(size)),
-        pixel_y_cache(image_height, std::vector<Geometry::Vec<3>>(size));
+        pixel_x_cache(size + 1, std::vector<Geometry::Vec<3>>(image_width)),
+        pixel_y_cache(size + 1, std::vector<Geometry::Vec<3>>(image_height));
 
-    for (unsigned i = 0; i < size; ++i) {
+    auto place = [ & ] (unsigned index, const Geometry::Vec<2> &sample) {
         for (unsigned pixel_y = 0; pixel_y < image_height; ++pixel_y) {
-            pixel_y_cache[pixel_y][i] = (1.0 - (pixel_y + deviations[i][1]) * (2.0 * inv_image_height)) * y_ratio + camera_offset;
+            pixel_y_cache[index][pixel_y] = (1.0 - (pixel_y + sample[1]) * (2.0 * inv_image_height)) * y_ratio + camera_offset;
         }
         for (unsigned pixel_x = 0; pixel_x < image_width; ++pixel_x) {
-            pixel_x_cache[pixel_x][i] = ((pixel_x + deviations[i][0]) * (2.0 * inv_image_width) - 1.0) * x_ratio;
+            pixel_x_cache[index][pixel_x] = ((pixel_x + sample[0]) * (2.0 * inv_image_width) - 1.0) * x_ratio;
         }
+    };
+
+    for (unsigned i = 0; i < size; ++i) {
+        place(i, deviations[i]);
     }
 
-    #pragma omp parallel for schedule(dynamic, 1) collapse(2)
-    for (unsigned pixel_y = 0; pixel_y < image_height; ++pixel_y) {
-        for (unsigned pixel_x = 0; pixel_x < image_width; ++pixel_x) {
-            Pigment::Color accumulated(0.0, 0.0, 0.0);
+    RayTrace::TileScheduler scheduler(image_width, image_height, tile_size, thread_count);
+
+    // Traces every pixel once per sample, given as indices of the camera tables, and hands flush each finished tile
+    // with the summed colors of its pixels. When a mask is given, pixels whose entry is zero are skipped and left
+    // black. Samples are numbered from first_sample on, which together with the pixel seeds the Russian roulette of
+    // their rays.
+    auto render = [ & ] (
+        const std::vector<unsigned> &samples,
+        unsigned first_sample,
+        const std::function<void(const RayTrace::Tile &, const std::vector<Pigment::Color> &)> &flush,
+        const std::vector<unsigned char> *mask
+    ) {
+
+        const unsigned samples_size = samples.size();
+
+        scheduler.reset();
+
+        #pragma omp parallel num_threads(thread_count)
+        {
+            const unsigned thread = omp_get_thread_num();
+
+            RayTrace::Tile tile;
+            std::vector<Geometry::Line> lines;
+            std::vector<Pigment::Color> buffer;
+            RayTrace::Hit hits[PACKET_SIZE];
+
+            if (use_affinity) {
+                RayTrace::PinThread(thread);
+            }
+
+            while (scheduler.next(thread, tile)) {
+
+                buffer.assign(tile.width * tile.height, Pigment::Color(0.0, 0.0, 0.0));
+
+                for (unsigned pixel_y = tile.y; pixel_y < tile.y + tile.height; ++pixel_y) {
+
+                    if (debug_mode && tile.x == 0) {
+                        #pragma omp critical
+                        std::cout << "Line: " << pixel_y << std::endl;
+                    }
+
+                    for (unsigned first_x = tile.x; first_x < tile.x + tile.width; first_x += packet_width) {
+
+                        const unsigned group = std::min(packet_width, tile.x + tile.width - first_x);
+
+                        // Pixels of the group that are traced, the masked out ones being packed away
+                        unsigned columns[PACKET_SIZE], count = 0;
+
+                        for (unsigned lane = 0; lane < group; ++lane) {
+                            if (mask == nullptr || (*mask)[pixel_y * image_width + first_x + lane]) {
+                                columns[count++] = lane;
+                            }
+                        }
+
+                        if (count == 0) {
+                            continue;
+                        }
+
+                        Pigment::Color *accumulated = &buffer[(pixel_y - tile.y) * tile.width + (first_x - tile.x)];
+
+                        for (unsigned i = 0; i < samples_size; ++i) {
+
+                            lines.clear();
+
+                            for (unsigned lane = 0; lane < count; ++lane) {
+                                const Geometry::Vec<3> position = pixel_x_cache[samples[i]][first_x + columns[lane]] + pixel_y_cache[samples[i]][pixel_y];
+                                lines.emplace_back(position, use_orthogonal ? camera_direction.normalized() : (position - eye_pos).normalized());
+                            }
+
+                            if (use_packets) {
+                                for (unsigned lane = 0; lane < count; ++lane) {
+                                    hits[lane] = RayTrace::Hit();
+                                }
+                                RayTrace::Intersect(lines.data(), count, shape_set, hits);
+                            } else {
+                                hits[0] = RayTrace::Hit();
+                                RayTrace::Intersect(lines[0], shape_set, hits[0]);
+                            }
+
+                            for (unsigned lane = 0; lane < count; ++lane) {
+                                accumulated[columns[lane]] += RayTrace::Trace(
+                                    lines[lane], hits[lane],
+                                    shape_set, scene.ambient, light_set,
+                                    light_deviations, reflect_deviations, transmit_deviations, { 0.5, 0.5, 0.5, 0.0 }, recursion_levels,
+                                    pruning, shadow_sampling, 1.0, 0, spread,
+                                    RayTrace::Mix(pixel_y * image_width + first_x + columns[lane], first_sample + i)
+                                );
+                            }
+                        }
+                    }
+                }
+
+                flush(tile, buffer);
+            }
+
+            RayTrace::FlushShadowCacheStats();
+        }
+    };
+
+    if (use_adaptive) {
+
+        const unsigned pixels = image_width * image_height;
+
+        std::vector<Pigment::Color>
+            framebuffer(pixels, Pigment::Color(0.0, 0.0, 0.0)),
+            squares(pixels, Pigment::Color(0.0, 0.0, 0.0));
+        std::vector<unsigned char> refine(pixels, 1), next(pixels, 0);
+        std::vector<unsigned> counts(pixels, 0);
+        std::vector<unsigned> ordered;
+
+        // Walks the samples with a stride close to the golden ratio of their amount, so that the first few
+        // taken from any pixel are spread over it instead of bunched on one row of the grid
+        auto coprime = [ size ] (unsigned stride) {
+            unsigned first = size, second = stride;
+            while (second != 0) {
+                std::swap(first, second);
+                second %= first;
+            }
+            return first == 1;
+        };
+
+        unsigned stride = std::max(1u, static_cast<unsigned>(size * 0.618));
+        while (!coprime(stride)) {
+            ++stride;
+        }
+        for (unsigned i = 0; i < size; ++i) {
+            ordered.push_back((static_cast<unsigned long long>(i) * stride) % size);
+        }
 
-            if (debug_mode && pixel_x == 0) {
-                std::cout << "Line: " << pixel_y << std::endl;
+        unsigned long long rays = 0;
+        unsigned taken = 0;
+
+        while (true) {
+
+            const unsigned round = std::min(adaptive_samples, size - taken);
+
+            for (unsigned i = 0; i < round; ++i) {
+                render({ ordered[taken + i] }, taken + i, [ & ] (const RayTrace::Tile &tile, const std::vector<Pigment::Color> &buffer) {
+                    for (unsigned row = 0; row < tile.height; ++row) {
+                        for (unsigned column = 0; column < tile.width; ++column) {
+                            const unsigned pixel = (tile.y + row) * image_width + tile.x + column;
+                            const Pigment::Color &color = buffer[row * tile.width + column];
+                            framebuffer[pixel] += color;
+                            squares[pixel] += color * color;
+                        }
+                    }
+                }, &refine);
             }
 
-            for (unsigned i = 0; i < size; ++i) {
+            taken += round;
 
-                const Geometry::Vec<3> position = pixel_x_cache[pixel_x][i] + pixel_y_cache[pixel_y][i];
+            for (unsigned pixel = 0; pixel < pixels; ++pixel) {
+                if (refine[pixel]) {
+                    counts[pixel] = taken;
+                    rays += round;
+                }
+            }
 
-                accumulated += RayTrace::Trace(
-                    Geometry::Line(position, use_orthogonal ? camera_direction.normalized() : (position - eye_pos).normalized()),
-                    shapes, ambient, lights,
-                    light_deviations, reflect_deviations, transmit_deviations, { 0.5, 0.5, 0.5, 0.0 }, recursion_levels
-                );
+            if (taken >= size) {
+                break;
             }
 
-            img.at<cv::Vec3b>(pixel_y, pixel_x) = static_cast<Pigment::Color>(accumulated / size).intervalFixed();
+            // A pixel keeps sampling while its samples disagree, or while it differs from a neighbour by more than
+            // the threshold, which catches edges that the first samples happened to land on the same side of
+            #pragma omp parallel for num_threads(thread_count)
+            for (unsigned pixel = 0; pixel < pixels; ++pixel) {
+
+                next[pixel] = 0;
+
+                if (!refine[pixel]) {
+                    continue;
+                }
+
+                const unsigned pixel_x = pixel % image_width, pixel_y = pixel / image_width;
+                const Pigment::Color mean = framebuffer[pixel] / counts[pixel];
+                float_max_t contrast = 0.0;
+
+                for (unsigned channel = 0; channel < 3; ++channel) {
+                    const float_max_t deviation = squares[pixel][channel] / counts[pixel] - mean[channel] * mean[channel];
+                    contrast = std::max(contrast, std::sqrt(std::max(deviation, 0.0)));
+                }
+
+                for (const int offset : { -1, 1, -static_cast<int>(image_width), static_cast<int>(image_width) }) {
+                    const int neighbour = static_cast<int>(pixel) + offset;
+                    if ((offset == -1 && pixel_x == 0) || (offset == 1 && pixel_x + 1 == image_width) ||
+                        (offset < -1 && pixel_y == 0) || (offset > 1 && pixel_y + 1 == image_height)) {
+                        continue;
+                    }
+                    const Pigment::Color other = framebuffer[neighbour] / counts[neighbour];
+                    for (unsigned channel = 0; channel < 3; ++channel) {
+                        contrast = std::max(contrast, std::abs(mean[channel] - other[channel]));
+                    }
+                }
+
+                next[pixel] = contrast > adaptive_threshold;
+            }
+
+            std::swap(refine, next);
+
+            if (std::find(refine.begin(), refine.end(), 1) == refine.end()) {
+                break;
+            }
+        }
+
+        for (unsigned pixel_y = 0; pixel_y < image_height; ++pixel_y) {
+            cv::Vec3b *line = img.ptr<cv::Vec3b>(pixel_y);
+            for (unsigned pixel_x = 0; pixel_x < image_width; ++pixel_x) {
+                const unsigned pixel = pixel_y * image_width + pixel_x;
+                line[pixel_x] = static_cast<Pigment::Color>(framebuffer[pixel] / counts[pixel]).intervalFixed();
+            }
         }
+
+        cv::imwrite(output_file, img);
+
+        std::cout << "Traced " << rays << " primary rays, " << static_cast<float_max_t>(rays) / pixels << " per pixel." << std::endl;
+
+    } else if (!use_progressive) {
+
+        std::vector<unsigned> all(size);
+        std::iota(all.begin(), all.end(), 0);
+
+        render(all, 0, [ & ] (const RayTrace::Tile &tile, const std::vector<Pigment::Color> &buffer) {
+            // Every row of the tile is written at once, so threads only touch the image when a tile is done
+            for (unsigned row = 0; row < tile.height; ++row) {
+                cv::Vec3b *line = img.ptr<cv::Vec3b>(tile.y + row) + tile.x;
+                for (unsigned column = 0; column < tile.width; ++column) {
+                    line[column] = static_cast<Pigment::Color>(buffer[row * tile.width + column] / size).intervalFixed();
+                }
+            }
+        }, nullptr);
+
+        cv::imwrite(output_file, img);
+
+    } else {
+
+        typedef std::chrono::duration<float_max_t> seconds;
+
+        // Running sums of every pixel over all passes, and of their squares to tell how noisy each one still is
+        std::vector<Pigment::Color>
+            framebuffer(image_width * image_height, Pigment::Color(0.0, 0.0, 0.0)),
+            squares(image_width * image_height, Pigment::Color(0.0, 0.0, 0.0));
+
+        unsigned passes = 0;
+        auto last_write = std::chrono::high_resolution_clock::now();
+
+        auto write = [ & ] () {
+            for (unsigned pixel_y = 0; pixel_y < image_height; ++pixel_y) {
+                cv::Vec3b *line = img.ptr<cv::Vec3b>(pixel_y);
+                for (unsigned pixel_x = 0; pixel_x < image_width; ++pixel_x) {
+                    line[pixel_x] = static_cast<Pigment::Color>(framebuffer[pixel_y * image_width + pixel_x] / passes).intervalFixed();
+                }
+            }
+            cv::imwrite(output_file, img);
+            last_write = std::chrono::high_resolution_clock::now();
+        };
+
+        // Variance of the mean of every pixel, averaged over the image and the color channels
+        auto variance = [ & ] () {
+            float_max_t total = 0.0;
+            #pragma omp parallel for reduction(+:total) num_threads(thread_count)
+            for (unsigned pixel = 0; pixel < image_width * image_height; ++pixel) {
+                for (unsigned channel = 0; channel < 3; ++channel) {
+                    const float_max_t mean = framebuffer[pixel][channel] / passes;
+                    total += std::max(squares[pixel][channel] / passes - mean * mean, 0.0) / (passes - 1);
+                }
+            }
+            return total / (3.0 * image_width * image_height);
+        };
+
+        while (true) {
+
+            const auto pass_start = std::chrono::high_resolution_clock::now();
+
+            // The regular samples come first, so stopping after as many passes gives the plain render.
+            // Later passes keep refining with a low-discrepancy sequence over the pixel area.
+            if (passes >= size) {
+                place(size, {
+                    std::fmod(0.5 + 0.7548776662466927 * (passes - size + 1), 1.0),
+                    std::fmod(0.5 + 0.5698402909980532 * (passes - size + 1), 1.0)
+                });
+            }
+
+            render({ std::min(passes, size) }, passes, [ & ] (const RayTrace::Tile &tile, const std::vector<Pigment::Color> &buffer) {
+                for (unsigned row = 0; row < tile.height; ++row) {
+                    for (unsigned column = 0; column < tile.width; ++column) {
+                        const unsigned pixel = (tile.y + row) * image_width + tile.x + column;
+                        const Pigment::Color &color = buffer[row * tile.width + column];
+                        framebuffer[pixel] += color;
+                        squares[pixel] += color * color;
+                    }
+                }
+            }, nullptr);
+
+            ++passes;
+
+            const auto now = std::chrono::high_resolution_clock::now();
+            const float_max_t
+                elapsed = std::chrono::duration_cast<seconds>(now - start_time).count(),
+                pass_time = std::chrono::duration_cast<seconds>(now - pass_start).count();
+
+            if (debug_mode) {
+                std::cout << "Pass: " << passes << " (" << pass_time << " seconds)" << std::endl;
+            }
+
+            bool done;
+
+            if (time_limit > 0.0 || target_variance > 0.0) {
+                // Stops as well when another pass would not fit in the time left
+                done = (time_limit > 0.0 && elapsed + pass_time > time_limit) ||
+                    (target_variance > 0.0 && passes > 1 && variance() <= target_variance);
+            } else {
+                done = passes >= size;
+            }
+
+            if (done) {
+                break;
+            }
+
+            if ((write_passes > 0 && passes % write_passes == 0) ||
+                (write_seconds > 0.0 && std::chrono::duration_cast<seconds>(now - last_write).count() >= write_seconds)) {
+                write();
+            }
+        }
+
+        write();
+
+        std::cout << "Rendered " << passes << " passes." << std::endl;
     }
 
-    cv::imwrite(output_file, img);
+    if (print_stats) {
+        const RayTrace::ShadowCacheStats shadows = RayTrace::GetShadowCacheStats();
+        std::cout << "Shadow rays: " << shadows.queries << ", blocked: " << shadows.blocked << ", found by the occluder cache: " << shadows.hits
+                  << " (" << (shadows.blocked > 0 ? 100.0 * shadows.hits / shadows.blocked : 0.0) << "% of blocked)" << std::endl;
+
+        std::size_t texture_bytes = 0;
+        for (const RayTrace::TextureCache::Usage &texture : RayTrace::TextureCache::instance().usage()) {
+            std::cout << "Texture " << texture.path << ": " << texture.width << "x" << texture.height << ", " << texture.levels
+                      << " levels, " << texture.references << " pigments, " << texture.bytes / 1024.0 << " KiB" << std::endl;
+            texture_bytes += texture.bytes;
+        }
+        std::cout << "Textures take " << texture_bytes / 1024.0 << " KiB." << std::endl;
+
+        std::cout << "Scene objects take " << scene.arena.getUsed() / 1024.0 << " KiB of " << scene.arena.getFootprint() / 1024.0
+                  << " KiB in " << scene.arena.getBlocks() << " blocks." << std::endl;
+    }
 
     std::cout << "Operation took " << std::chrono::duration_cast<std::chrono::duration<float_max_t>>(
         std::chrono::high_resolution_clock::now() - start_time
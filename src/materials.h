@@ -0,0 +1,103 @@
+#ifndef SRC_MATERIALS_H_
+#define SRC_MATERIALS_H_
+
+#include <algorithm>
+#include "graphics/graphics.h"
+#include "arena.h"
+
+namespace RayTrace {
+
+    // Everything Trace reads from a Light::Material, as plain values that are cheap to copy into a hit
+    struct Material {
+
+        float_max_t ambient = 0.0, diffuse = 0.0, specular = 0.0, alpha = 1.0, reflect = 0.0, transmit = 0.0, ior = 1.0;
+        float_max_t normal[3] = { 0.0, 0.0, 0.0 };
+
+        Material () {}
+
+        Material (const Light::Material &material) :
+            ambient(material.getAmbient()),
+            diffuse(material.getDiffuse()),
+            specular(material.getSpecular()),
+            alpha(material.getAlpha()),
+            reflect(material.getReflect()),
+            transmit(material.getTransmit()),
+            ior(material.getIOR()) {
+            const Geometry::Vec<3> &perturbation = material.getNormal();
+            for (unsigned i = 0; i < 3; ++i) {
+                this->normal[i] = perturbation[i];
+            }
+        }
+
+        inline float_max_t getAmbient () const { return this->ambient; }
+        inline float_max_t getDiffuse () const { return this->diffuse; }
+        inline float_max_t getSpecular () const { return this->specular; }
+        inline float_max_t getAlpha () const { return this->alpha; }
+        inline float_max_t getReflect () const { return this->reflect; }
+        inline float_max_t getTransmit () const { return this->transmit; }
+        inline float_max_t getIOR () const { return this->ior; }
+        inline Geometry::Vec<3> getNormal () const { return { this->normal[0], this->normal[1], this->normal[2] }; }
+
+        inline bool operator== (const Material &other) const {
+            return this->ambient == other.ambient && this->diffuse == other.diffuse && this->specular == other.specular &&
+                this->alpha == other.alpha && this->reflect == other.reflect && this->transmit == other.transmit &&
+                this->ior == other.ior && std::equal(this->normal, this->normal + 3, other.normal);
+        }
+    };
+
+    // Light::Surface made of constants only, which also keeps them as a Material for Shade to use directly.
+    // Its channels are made in arena, which frees them along with it.
+    class BakedSurface : public Light::Surface {
+
+        Material baked;
+
+        static inline Material bake (
+            float_max_t ambient,
+            float_max_t diffuse,
+            float_max_t specular,
+            float_max_t alpha,
+            float_max_t reflect,
+            float_max_t transmit,
+            float_max_t ior
+        ) {
+            Material material;
+            material.ambient = ambient;
+            material.diffuse = diffuse;
+            material.specular = specular;
+            material.alpha = alpha;
+            material.reflect = reflect;
+            material.transmit = transmit;
+            material.ior = ior;
+            return material;
+        }
+
+    public:
+
+        BakedSurface (
+            Arena &arena,
+            float_max_t ambient,
+            float_max_t diffuse,
+            float_max_t specular,
+            float_max_t alpha,
+            float_max_t reflect,
+            float_max_t transmit,
+            float_max_t ior
+        ) :
+            Light::Surface(
+                arena.make<Light::Solid<1>>(ambient),
+                arena.make<Light::Solid<1>>(diffuse),
+                arena.make<Light::Solid<1>>(specular),
+                arena.make<Light::Solid<1>>(alpha),
+                arena.make<Light::Solid<1>>(reflect),
+                arena.make<Light::Solid<1>>(transmit),
+                arena.make<Light::Solid<1>>(ior),
+                arena.make<Light::Solid<3>>(Geometry::Vec<3>({ 0.0, 0.0, 0.0 }))
+            ),
+            baked(bake(ambient, diffuse, specular, alpha, reflect, transmit, ior)) {}
+
+        inline const Material &getBaked () const { return this->baked; }
+    };
+
+};
+
+#endif
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "mesh.h"
+
+namespace RayTrace {
+
+    namespace {
+
+        constexpr float_max_t NONE = std::numeric_limits<float_max_t>::max();
+
+        // Ray transformed so that it runs along +z from the origin, after Woop, Benthin and Wald, "Watertight
+        // Ray/Triangle Intersection". Edges shared by two triangles are then tested the same way from both, so no
+        // ray slips between them.
+        struct Shear {
+
+            unsigned kx, ky, kz;
+            float_trace_t sx, sy, sz;
+
+            Shear (const BVH::Ray &ray) {
+                const float_trace_t *d = ray.direction;
+                kz = std::abs(d[0]) > std::abs(d[1]) ? (std::abs(d[0]) > std::abs(d[2]) ? 0 : 2) : (std::abs(d[1]) > std::abs(d[2]) ? 1 : 2);
+                kx = (kz + 1) % 3;
+                ky = (kx + 1) % 3;
+                if (d[kz] < 0.0) {
+                    std::swap(kx, ky);
+                }
+                sx = d[kx] / d[kz];
+                sy = d[ky] / d[kz];
+                sz = 1.0 / d[kz];
+            }
+        };
+
+        // Distance and barycentric coordinates of the hit with triangle a, b, c when it lies in (near, distance)
+        inline bool triangle (
+            const Shear &shear,
+            const float_trace_t origin[3],
+            const float_trace_t *a,
+            const float_trace_t *b,
+            const float_trace_t *c,
+            float_trace_t near,
+            float_trace_t distance,
+            float_trace_t &t,
+            float_trace_t &u,
+            float_trace_t &v
+        ) {
+            const unsigned kx = shear.kx, ky = shear.ky, kz = shear.kz;
+
+            const float_trace_t
+                az = a[kz] - origin[kz], bz = b[kz] - origin[kz], cz = c[kz] - origin[kz],
+                ax = a[kx] - origin[kx] - shear.sx * az, ay = a[ky] - origin[ky] - shear.sy * az,
+                bx = b[kx] - origin[kx] - shear.sx * bz, by = b[ky] - origin[ky] - shear.sy * bz,
+                cx = c[kx] - origin[kx] - shear.sx * cz, cy = c[ky] - origin[ky] - shear.sy * cz;
+
+            float_trace_t
+                e0 = cx * by - cy * bx,
+                e1 = ax * cy - ay * cx,
+                e2 = bx * ay - by * ax;
+
+            // Edges the ray passes exactly through are decided again in double, which float_trace_t may be short of
+            if (sizeof(float_trace_t) < sizeof(double) && (e0 == 0.0 || e1 == 0.0 || e2 == 0.0)) {
+                e0 = static_cast<double>(cx) * by - static_cast<double>(cy) * bx;
+                e1 = static_cast<double>(ax) * cy - static_cast<double>(ay) * cx;
+                e2 = static_cast<double>(bx) * ay - static_cast<double>(by) * ax;
+            }
+
+            if ((e0 < 0.0 || e1 < 0.0 || e2 < 0.0) && (e0 > 0.0 || e1 > 0.0 || e2 > 0.0)) {
+                return false;
+            }
+
+            const float_trace_t determinant = e0 + e1 + e2;
+
+            if (determinant == 0.0) {
+                return false;
+            }
+
+            t = shear.sz * (e0 * az + e1 * bz + e2 * cz) / determinant;
+
+            if (!(t > near && t < distance)) {
+                return false;
+            }
+
+            u = e1 / determinant;
+            v = e2 / determinant;
+
+            return true;
+        }
+    }
+
+    Mesh::Mesh (
+        std::vector<float_trace_t> vertices,
+        std::vector<float_max_t> coordinates,
+        std::vector<std::uint32_t> triangles,
+        Pigment::Texture *pigment,
+        Light::Surface *surface
+    ) :
+        ::Shape::Shape(pigment, surface),
+        vertices(std::move(vertices)),
+        coordinates(std::move(coordinates)),
+        texture(pigment),
+        finish(surface) {
+
+        const std::uint32_t num_vertices = this->vertices.size() / 3;
+        std::vector<Bounds> triangle_bounds;
+        std::vector<std::uint32_t> kept;
+
+        if (this->coordinates.size() != 2 * static_cast<std::size_t>(num_vertices)) {
+            this->coordinates.clear();
+        }
+
+        for (std::size_t i = 0; i + 2 < triangles.size(); i += 3) {
+            if (triangles[i] < num_vertices && triangles[i + 1] < num_vertices && triangles[i + 2] < num_vertices) {
+                Bounds bounds;
+                for (unsigned corner = 0; corner < 3; ++corner) {
+                    const float_trace_t *vertex = &this->vertices[3 * triangles[i + corner]];
+                    for (unsigned axis = 0; axis < 3; ++axis) {
+                        bounds.min[axis] = std::min<float_max_t>(bounds.min[axis], vertex[axis]);
+                        bounds.max[axis] = std::max<float_max_t>(bounds.max[axis], vertex[axis]);
+                    }
+                }
+                triangle_bounds.push_back(bounds);
+                kept.insert(kept.end(), triangles.begin() + i, triangles.begin() + i + 3);
+                this->bounds.extend(bounds);
+            }
+        }
+
+        this->bvh.build(triangle_bounds);
+
+        // Leaves then cover contiguous ranges of triangles
+        for (unsigned index : this->bvh.getIndices()) {
+            this->triangles.insert(this->triangles.end(), kept.begin() + 3 * index, kept.begin() + 3 * index + 3);
+        }
+    }
+
+    bool Mesh::intersect (const BVH::Ray &ray, float_max_t &distance, Hit &hit, float_max_t near) const {
+
+        const Shear shear(ray);
+        const float_trace_t nearest = Narrow(near);
+        bool found = false;
+
+        this->bvh.traverseLeaves(ray, distance, [ & ] (unsigned offset, unsigned count) {
+            for (unsigned i = offset, end = offset + count; i < end; ++i) {
+                const std::uint32_t *corners = &this->triangles[3 * i];
+                float_trace_t t, u, v;
+                if (triangle(
+                    shear, ray.origin,
+                    &this->vertices[3 * corners[0]], &this->vertices[3 * corners[1]], &this->vertices[3 * corners[2]],
+                    nearest, Narrow(distance), t, u, v
+                )) {
+                    distance = t;
+                    hit.distance = t;
+                    hit.triangle = i;
+                    hit.u = u;
+                    hit.v = v;
+                    found = true;
+                }
+            }
+            return false;
+        });
+
+        if (found) {
+            const Geometry::Vec<3> normal = this->getNormal(hit.triangle);
+            hit.front = normal[0] * ray.direction[0] + normal[1] * ray.direction[1] + normal[2] * ray.direction[2] < 0.0;
+        }
+
+        return found;
+    }
+
+    bool Mesh::occludes (const BVH::Ray &ray, float_max_t distance) const {
+
+        const Shear shear(ray);
+        const float_trace_t limit = Narrow(distance);
+
+        return this->bvh.traverseLeaves(ray, distance, [ & ] (unsigned offset, unsigned count) {
+            for (unsigned i = offset, end = offset + count; i < end; ++i) {
+                const std::uint32_t *corners = &this->triangles[3 * i];
+                float_trace_t t, u, v;
+                if (triangle(
+                    shear, ray.origin,
+                    &this->vertices[3 * corners[0]], &this->vertices[3 * corners[1]], &this->vertices[3 * corners[2]],
+                    0.0, limit, t, u, v
+                )) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    Geometry::Vec<3> Mesh::getNormal (unsigned triangle) const {
+        const std::uint32_t *corners = &this->triangles[3 * triangle];
+        const float_trace_t
+            *a = &this->vertices[3 * corners[0]],
+            *b = &this->vertices[3 * corners[1]],
+            *c = &this->vertices[3 * corners[2]];
+        const float_max_t
+            e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] },
+            e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+        return Geometry::Vec<3>({ e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] });
+    }
+
+    Geometry::Vec<2> Mesh::coordinatesAt (const Hit &hit) const {
+
+        if (this->coordinates.empty()) {
+            return { hit.u, hit.v };
+        }
+
+        const std::uint32_t *corners = &this->triangles[3 * hit.triangle];
+        const float_max_t
+            *a = &this->coordinates[2 * corners[0]],
+            *b = &this->coordinates[2 * corners[1]],
+            *c = &this->coordinates[2 * corners[2]],
+            w = 1.0 - hit.u - hit.v;
+
+        return { w * a[0] + hit.u * b[0] + hit.v * c[0], w * a[1] + hit.u * b[1] + hit.v * c[1] };
+    }
+
+    Pigment::Color Mesh::colorAt (const Hit &hit, const Geometry::Vec<3> &point) const {
+
+        if (this->texture == nullptr) {
+            return Pigment::Color(0.0, 0.0, 0.0);
+        }
+
+        return this->texture->getColor(this->coordinatesAt(hit), point);
+    }
+
+    void Mesh::materialAt (const Hit &hit, Light::Material &material) const {
+        if (this->finish != nullptr) {
+            material = this->finish->getMaterial(this->coordinatesAt(hit));
+        }
+    }
+
+    bool Mesh::intersectLine (
+        const Geometry::Line &line,
+        float_max_t &t_min,
+        float_max_t &t_max,
+        bool get_info,
+        Geometry::Vec<3> &normal_min,
+        Geometry::Vec<3> &normal_max,
+        bool &inside_min,
+        bool &inside_max,
+        Pigment::Color &color_min,
+        Pigment::Color &color_max,
+        Light::Material &material_min,
+        Light::Material &material_max
+    ) const {
+
+        const BVH::Ray ray(line);
+        float_max_t distance = NONE, distance_leave = NONE;
+        Hit first, second;
+
+        if (!this->intersect(ray, distance, first)) {
+            return false;
+        }
+
+        // Entering, the ray leaves at the next triangle if there is one. Leaving, it was inside from the start.
+        const bool leaves = first.front && this->intersect(ray, distance_leave, second, first.distance);
+
+        t_min = first.front ? first.distance : -NONE;
+        t_max = first.front ? (leaves ? second.distance : NONE) : first.distance;
+
+        // An end the mesh does not close, behind the origin or past the last triangle, is given the hit that was found
+        if (get_info) {
+            const Geometry::Vec<3> normal = this->getNormal(first.triangle);
+            normal_min = normal * (1.0 / normal.length());
+            normal_max = normal * (-1.0 / normal.length());
+            inside_min = false;
+            inside_max = true;
+            color_min = color_max = this->colorAt(first, line.at(first.distance));
+            this->materialAt(first, material_min);
+            material_max = material_min;
+            if (leaves) {
+                const Geometry::Vec<3> normal_leave = this->getNormal(second.triangle);
+                normal_max = normal_leave * (-1.0 / normal_leave.length());
+                color_max = this->colorAt(second, line.at(second.distance));
+                this->materialAt(second, material_max);
+            }
+        }
+
+        return true;
+    }
+
+};
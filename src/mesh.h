@@ -0,0 +1,87 @@
+#ifndef SRC_MESH_H_
+#define SRC_MESH_H_
+
+#include <cstdint>
+#include <vector>
+#include "graphics/graphics.h"
+#include "bvh.h"
+
+namespace RayTrace {
+
+    // Triangles over a shared array of vertices, kept in the leaf order of their own BVH. Meshes are read as closed
+    // surfaces, counterclockwise faces pointing outwards, and are parameterized by the texture coordinates of their
+    // vertices when the file has them and by the barycentric coordinates of every triangle otherwise.
+    class Mesh : public Shape::Shape {
+
+    public:
+
+        struct Hit {
+            float_max_t distance;
+            unsigned triangle;
+            // Barycentric coordinates of the hit relative to the second and third vertices
+            float_max_t u, v;
+            // Whether the ray hit the outer side of the triangle
+            bool front;
+        };
+
+    private:
+
+        // x, y and z of every vertex, and u and v when there are texture coordinates
+        std::vector<float_trace_t> vertices;
+        std::vector<float_max_t> coordinates;
+        // Three vertex indices per triangle
+        std::vector<std::uint32_t> triangles;
+        BVH bvh;
+        Bounds bounds;
+        Pigment::Texture *texture;
+        Light::Surface *finish;
+
+        Geometry::Vec<2> coordinatesAt (const Hit &hit) const;
+
+    public:
+
+        // Takes the vertices and triangles over, dropping the triangles with an index out of range
+        Mesh (
+            std::vector<float_trace_t> vertices,
+            std::vector<float_max_t> coordinates,
+            std::vector<std::uint32_t> triangles,
+            Pigment::Texture *pigment,
+            Light::Surface *surface
+        );
+
+        inline unsigned getTriangles () const { return this->triangles.size() / 3; }
+        inline unsigned getVertices () const { return this->vertices.size() / 3; }
+        inline const Bounds &getBounds () const { return this->bounds; }
+
+        // Nearest hit past near and before distance, which it shrinks to that of the hit
+        bool intersect (const BVH::Ray &ray, float_max_t &distance, Hit &hit, float_max_t near = 0.0) const;
+
+        // Whether any triangle lies on the ray between its origin and distance
+        bool occludes (const BVH::Ray &ray, float_max_t distance) const;
+
+        // Outward normal of a triangle, not normalized
+        Geometry::Vec<3> getNormal (unsigned triangle) const;
+
+        // Pigment and surface of the mesh at a hit, the material left as it is when the mesh has no surface
+        Pigment::Color colorAt (const Hit &hit, const Geometry::Vec<3> &point) const;
+        void materialAt (const Hit &hit, Light::Material &material) const;
+
+        bool intersectLine (
+            const Geometry::Line &line,
+            float_max_t &t_min,
+            float_max_t &t_max,
+            bool get_info,
+            Geometry::Vec<3> &normal_min,
+            Geometry::Vec<3> &normal_max,
+            bool &inside_min,
+            bool &inside_max,
+            Pigment::Color &color_min,
+            Pigment::Color &color_max,
+            Light::Material &material_min,
+            Light::Material &material_max
+        ) const override;
+    };
+
+};
+
+#endif
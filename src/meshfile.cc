@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include "filemanip.h"
+
+namespace FileManip {
+
+    namespace {
+
+        inline bool isBlank (char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+
+        // Splits [data, end) into lines and the lines into words, all in place
+        struct Words {
+
+            const char *data, *end, *line_end;
+            unsigned line = 0;
+
+            Words (const char *data, const char *end) : data(data), end(end), line_end(data) {}
+
+            bool nextLine () {
+                if (this->line_end == this->end) {
+                    return false;
+                }
+                this->data = this->line == 0 ? this->line_end : this->line_end + 1;
+                if (this->data > this->end) {
+                    this->data = this->line_end = this->end;
+                    return false;
+                }
+                const void *newline = std::memchr(this->data, '\n', this->end - this->data);
+                this->line_end = newline != nullptr ? static_cast<const char *>(newline) : this->end;
+                ++this->line;
+                return true;
+            }
+
+            // Next word of the line as [begin, data), empty at its end
+            const char *next () {
+                while (this->data < this->line_end && isBlank(*this->data)) {
+                    ++this->data;
+                }
+                const char *begin = this->data;
+                while (this->data < this->line_end && !isBlank(*this->data)) {
+                    ++this->data;
+                }
+                return begin;
+            }
+
+            bool is (const char *begin, const char *word) const {
+                const std::size_t length = std::strlen(word);
+                return static_cast<std::size_t>(this->data - begin) == length && std::equal(begin, this->data, word);
+            }
+
+            bool number (float_max_t &value) {
+                const char *begin = this->next();
+                return begin != this->data && parseNumber(begin, this->data, value);
+            }
+
+            std::string where () const { return "line " + std::to_string(this->line); }
+        };
+
+        // OBJ index, counted from 1 or backwards from the last element when negative, into [0, size)
+        bool objIndex (const char *begin, const char *end, std::size_t size, std::uint32_t &index) {
+
+            const bool negative = begin < end && *begin == '-';
+            std::uint64_t value = 0;
+
+            if (negative) {
+                ++begin;
+            }
+            if (begin == end) {
+                return false;
+            }
+            for (; begin < end; ++begin) {
+                if (*begin < '0' || *begin > '9' || value > size) {
+                    return false;
+                }
+                value = value * 10 + (*begin - '0');
+            }
+            if (value == 0 || value > size) {
+                return false;
+            }
+
+            index = negative ? size - value : value - 1;
+            return true;
+        }
+
+        bool readOBJ (
+            const char *data,
+            const char *end,
+            std::vector<RayTrace::float_trace_t> &vertices,
+            std::vector<float_max_t> &coordinates,
+            std::vector<std::uint32_t> &triangles,
+            std::string &error
+        ) {
+
+            Words words(data, end);
+            std::vector<float_max_t> positions, texture;
+            std::vector<std::uint32_t> corners;
+            // Vertex made for every pair of position and texture coordinates used by a face
+            std::unordered_map<std::uint64_t, std::uint32_t> pairs;
+
+            while (words.nextLine()) {
+
+                const char *type = words.next();
+
+                if (words.is(type, "v")) {
+                    float_max_t x, y, z;
+                    if (!words.number(x) || !words.number(y) || !words.number(z)) {
+                        error = words.where() + ": expected three coordinates";
+                        return false;
+                    }
+                    positions.insert(positions.end(), { x, y, z });
+                } else if (words.is(type, "vt")) {
+                    float_max_t u, v = 0.0;
+                    if (!words.number(u)) {
+                        error = words.where() + ": expected texture coordinates";
+                        return false;
+                    }
+                    words.number(v);
+                    texture.insert(texture.end(), { u, v });
+                } else if (words.is(type, "f")) {
+
+                    corners.clear();
+
+                    for (const char *corner = words.next(); corner != words.data; corner = words.next()) {
+
+                        const char *slash = std::find(corner, words.data, '/');
+                        std::uint32_t position, coordinate = 0;
+                        bool textured = false;
+
+                        if (!objIndex(corner, slash, positions.size() / 3, position)) {
+                            error = words.where() + ": vertex '" + std::string(corner, words.data) + "' does not exist";
+                            return false;
+                        }
+
+                        if (slash != words.data) {
+                            const char *second = std::find(slash + 1, words.data, '/');
+                            textured = second != slash + 1;
+                            if (textured && !objIndex(slash + 1, second, texture.size() / 2, coordinate)) {
+                                error = words.where() + ": texture coordinates '" + std::string(corner, words.data) + "' do not exist";
+                                return false;
+                            }
+                        }
+
+                        const std::uint64_t key = (static_cast<std::uint64_t>(position) << 32) | (textured ? coordinate + 1 : 0);
+                        const auto inserted = pairs.emplace(key, static_cast<std::uint32_t>(vertices.size() / 3));
+
+                        if (inserted.second) {
+                            vertices.insert(vertices.end(), positions.begin() + 3 * position, positions.begin() + 3 * position + 3);
+                            coordinates.push_back(textured ? texture[2 * coordinate] : 0.0);
+                            coordinates.push_back(textured ? texture[2 * coordinate + 1] : 0.0);
+                        }
+
+                        corners.push_back(inserted.first->second);
+                    }
+
+                    // Polygons are split into a fan around their first corner
+                    for (std::size_t i = 2; i < corners.size(); ++i) {
+                        triangles.insert(triangles.end(), { corners[0], corners[i - 1], corners[i] });
+                    }
+                }
+            }
+
+            if (texture.empty()) {
+                coordinates.clear();
+            }
+
+            return true;
+        }
+
+        struct PlyProperty {
+            std::string name, type, count_type;
+            bool list;
+        };
+
+        struct PlyElement {
+            std::string name;
+            std::size_t count;
+            std::vector<PlyProperty> properties;
+        };
+
+        // Values of the body of a PLY file, as text or as binary in either byte order
+        struct PlyValues {
+
+            enum Format { ASCII, LITTLE, BIG };
+
+            Format format;
+            const char *data, *end;
+
+            bool ascii (float_max_t &value) {
+                while (this->data < this->end && std::isspace(static_cast<unsigned char>(*this->data))) {
+                    ++this->data;
+                }
+                const char *begin = this->data;
+                while (this->data < this->end && !std::isspace(static_cast<unsigned char>(*this->data))) {
+                    ++this->data;
+                }
+                return begin != this->data && parseNumber(begin, this->data, value);
+            }
+
+            template <typename T>
+            bool binary (float_max_t &value) {
+                unsigned char bytes[sizeof(T)];
+                T stored;
+                if (static_cast<std::size_t>(this->end - this->data) < sizeof(T)) {
+                    return false;
+                }
+                std::memcpy(bytes, this->data, sizeof(T));
+                this->data += sizeof(T);
+                const std::uint16_t probe = 1;
+                const bool little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+                if (little != (this->format == LITTLE)) {
+                    std::reverse(bytes, bytes + sizeof(T));
+                }
+                std::memcpy(&stored, bytes, sizeof(T));
+                value = stored;
+                return true;
+            }
+
+            bool read (const std::string &type, float_max_t &value) {
+                if (this->format == ASCII) {
+                    return this->ascii(value);
+                } else if (type == "char" || type == "int8") {
+                    return this->binary<std::int8_t>(value);
+                } else if (type == "uchar" || type == "uint8") {
+                    return this->binary<std::uint8_t>(value);
+                } else if (type == "short" || type == "int16") {
+                    return this->binary<std::int16_t>(value);
+                } else if (type == "ushort" || type == "uint16") {
+                    return this->binary<std::uint16_t>(value);
+                } else if (type == "int" || type == "int32") {
+                    return this->binary<std::int32_t>(value);
+                } else if (type == "uint" || type == "uint32") {
+                    return this->binary<std::uint32_t>(value);
+                } else if (type == "float" || type == "float32") {
+                    return this->binary<float>(value);
+                } else if (type == "double" || type == "float64") {
+                    return this->binary<double>(value);
+                }
+                return false;
+            }
+        };
+
+        bool readPLY (
+            const char *data,
+            const char *end,
+            std::vector<RayTrace::float_trace_t> &vertices,
+            std::vector<float_max_t> &coordinates,
+            std::vector<std::uint32_t> &triangles,
+            std::string &error
+        ) {
+
+            Words words(data, end);
+            std::vector<PlyElement> elements;
+            PlyValues values = { PlyValues::ASCII, end, end };
+            bool header = false;
+
+            while (!header && words.nextLine()) {
+
+                const char *keyword = words.next();
+                auto word = [ & ] () { const char *begin = words.next(); return std::string(begin, words.data); };
+
+                if (words.line == 1 && !words.is(keyword, "ply")) {
+                    error = "not a PLY file";
+                    return false;
+                } else if (words.is(keyword, "format")) {
+                    const std::string format = word();
+                    if (format == "ascii") {
+                        values.format = PlyValues::ASCII;
+                    } else if (format == "binary_little_endian") {
+                        values.format = PlyValues::LITTLE;
+                    } else if (format == "binary_big_endian") {
+                        values.format = PlyValues::BIG;
+                    } else {
+                        error = words.where() + ": unknown format '" + format + "'";
+                        return false;
+                    }
+                } else if (words.is(keyword, "element")) {
+                    const std::string name = word(), count = word();
+                    float_max_t parsed;
+                    if (!parseNumber(count.data(), count.data() + count.size(), parsed) || parsed < 0.0) {
+                        error = words.where() + ": bad element count '" + count + "'";
+                        return false;
+                    }
+                    elements.push_back({ name, static_cast<std::size_t>(parsed), {} });
+                } else if (words.is(keyword, "property")) {
+                    if (elements.empty()) {
+                        error = words.where() + ": property outside of an element";
+                        return false;
+                    }
+                    const std::string type = word();
+                    if (type == "list") {
+                        const std::string count_type = word(), item_type = word();
+                        elements.back().properties.push_back({ word(), item_type, count_type, true });
+                    } else {
+                        elements.back().properties.push_back({ word(), type, "", false });
+                    }
+                } else if (words.is(keyword, "end_header")) {
+                    header = true;
+                    values.data = words.line_end < end ? words.line_end + 1 : end;
+                }
+            }
+
+            if (!header) {
+                error = "the header has no end";
+                return false;
+            }
+
+            for (const PlyElement &element : elements) {
+
+                const bool is_vertex = element.name == "vertex", is_face = element.name == "face";
+                int fields[5] = { -1, -1, -1, -1, -1 };
+
+                for (unsigned i = 0; i < element.properties.size(); ++i) {
+                    const std::string &name = element.properties[i].name;
+                    const int field = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 :
+                        (name == "u" || name == "s" || name == "texture_u") ? 3 :
+                        (name == "v" || name == "t" || name == "texture_v") ? 4 : -1;
+                    if (field >= 0) {
+                        fields[field] = i;
+                    }
+                }
+
+                if (is_vertex && (fields[0] < 0 || fields[1] < 0 || fields[2] < 0)) {
+                    error = "the vertices have no position";
+                    return false;
+                }
+
+                const bool textured = is_vertex && fields[3] >= 0 && fields[4] >= 0;
+                std::vector<std::uint32_t> corners;
+
+                for (std::size_t item = 0; item < element.count; ++item) {
+
+                    float_max_t position[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+                    for (unsigned i = 0; i < element.properties.size(); ++i) {
+
+                        const PlyProperty &property = element.properties[i];
+                        float_max_t value;
+
+                        if (!property.list) {
+                            if (!values.read(property.type, value)) {
+                                error = "element " + element.name + " " + std::to_string(item) + " is cut short or has a bad value";
+                                return false;
+                            }
+                            for (unsigned field = 0; field < 5; ++field) {
+                                if (fields[field] == static_cast<int>(i)) {
+                                    position[field] = value;
+                                }
+                            }
+                            continue;
+                        }
+
+                        float_max_t count;
+                        const bool indices = is_face && (property.name == "vertex_indices" || property.name == "vertex_index");
+
+                        if (!values.read(property.count_type, count) || count < 0.0 || count != std::floor(count)) {
+                            error = "element " + element.name + " " + std::to_string(item) + " is cut short or has a bad value";
+                            return false;
+                        }
+
+                        corners.clear();
+                        for (unsigned j = 0; j < static_cast<unsigned>(count); ++j) {
+                            if (!values.read(property.type, value)) {
+                                error = "element " + element.name + " " + std::to_string(item) + " is cut short or has a bad value";
+                                return false;
+                            }
+                            if (!indices) {
+                                continue;
+                            }
+                            if (value < 0.0 || value != std::floor(value) || value > 4294967295.0) {
+                                error = "element " + element.name + " " + std::to_string(item) + " has a vertex index that is negative or not a whole number";
+                                return false;
+                            }
+                            corners.push_back(static_cast<std::uint32_t>(value));
+                        }
+
+                        if (indices) {
+                            for (std::size_t j = 2; j < corners.size(); ++j) {
+                                triangles.insert(triangles.end(), { corners[0], corners[j - 1], corners[j] });
+                            }
+                        }
+                    }
+
+                    if (is_vertex) {
+                        vertices.insert(vertices.end(), position, position + 3);
+                        if (textured) {
+                            coordinates.insert(coordinates.end(), position + 3, position + 5);
+                        }
+                    }
+                }
+            }
+
+            // The faces may come before the vertices, so only now can their indices be told apart from missing ones
+            for (std::size_t i = 0; i < triangles.size(); ++i) {
+                if (triangles[i] >= vertices.size() / 3) {
+                    error = "face triangle " + std::to_string(i / 3) + " uses vertex " + std::to_string(triangles[i]) + ", which does not exist";
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    bool loadMesh (
+        const std::string &path,
+        std::vector<RayTrace::float_trace_t> &vertices,
+        std::vector<float_max_t> &coordinates,
+        std::vector<std::uint32_t> &triangles,
+        std::string &error
+    ) {
+
+        const MappedFile file(path);
+        const std::size_t dot = path.find_last_of('.');
+        const std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+
+        if (!file.isOpen()) {
+            error = "cannot open it or it is empty";
+            return false;
+        }
+
+        if (extension == "obj" || extension == "OBJ") {
+            return readOBJ(file.getData(), file.getData() + file.getSize(), vertices, coordinates, triangles, error);
+        } else if (extension == "ply" || extension == "PLY") {
+            return readPLY(file.getData(), file.getData() + file.getSize(), vertices, coordinates, triangles, error);
+        }
+
+        error = "only .obj and .ply files are supported";
+        return false;
+    }
+
+};
@@ -0,0 +1,105 @@
+#include <numeric>
+#include <random>
+#include "pigments.h"
+
+namespace RayTrace {
+
+    constexpr unsigned PerlinNoise::BATCH_SIZE;
+
+    void PerlinNoise::shuffle (unsigned seed) {
+        std::default_random_engine engine(seed);
+        std::iota(this->permutation, this->permutation + 256, 0);
+        std::shuffle(this->permutation, this->permutation + 256, engine);
+        std::copy(this->permutation, this->permutation + 256, this->permutation + 256);
+    }
+
+    void PerlinNoise::at (const float_max_t x[], const float_max_t y[], const float_max_t z[], unsigned count, float_max_t noise[]) const {
+
+        constexpr unsigned W = BATCH_SIZE;
+
+        const int *p = this->permutation;
+
+        for (unsigned offset = 0; offset < count; offset += W) {
+
+            const unsigned size = std::min(count - offset, W);
+
+            float_max_t fx[W], fy[W], fz[W], u[W], v[W], w[W];
+            int hash[8][W];
+
+            // Unused lanes repeat the last point, so every loop below runs over the whole batch
+            #pragma omp simd
+            for (unsigned lane = 0; lane < W; ++lane) {
+                const unsigned i = offset + std::min(lane, size - 1);
+                const float_max_t floor_x = std::floor(x[i]), floor_y = std::floor(y[i]), floor_z = std::floor(z[i]);
+                const int X = static_cast<int>(floor_x) & 255, Y = static_cast<int>(floor_y) & 255, Z = static_cast<int>(floor_z) & 255;
+                fx[lane] = x[i] - floor_x;
+                fy[lane] = y[i] - floor_y;
+                fz[lane] = z[i] - floor_z;
+                u[lane] = fade(fx[lane]);
+                v[lane] = fade(fy[lane]);
+                w[lane] = fade(fz[lane]);
+                const int
+                    A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z,
+                    B = p[X + 1] + Y, BA = p[B] + Z, BB = p[B + 1] + Z;
+                hash[0][lane] = p[AA];
+                hash[1][lane] = p[BA];
+                hash[2][lane] = p[AB];
+                hash[3][lane] = p[BB];
+                hash[4][lane] = p[AA + 1];
+                hash[5][lane] = p[BA + 1];
+                hash[6][lane] = p[AB + 1];
+                hash[7][lane] = p[BB + 1];
+            }
+
+            float_max_t result[W];
+
+            #pragma omp simd
+            for (unsigned lane = 0; lane < W; ++lane) {
+                const float_max_t
+                    x_0 = fx[lane], y_0 = fy[lane], z_0 = fz[lane],
+                    x_1 = x_0 - 1.0, y_1 = y_0 - 1.0, z_1 = z_0 - 1.0;
+                const float_max_t value = lerp(w[lane],
+                    lerp(v[lane],
+                        lerp(u[lane], grad(hash[0][lane], x_0, y_0, z_0), grad(hash[1][lane], x_1, y_0, z_0)),
+                        lerp(u[lane], grad(hash[2][lane], x_0, y_1, z_0), grad(hash[3][lane], x_1, y_1, z_0))
+                    ),
+                    lerp(v[lane],
+                        lerp(u[lane], grad(hash[4][lane], x_0, y_0, z_1), grad(hash[5][lane], x_1, y_0, z_1)),
+                        lerp(u[lane], grad(hash[6][lane], x_0, y_1, z_1), grad(hash[7][lane], x_1, y_1, z_1))
+                    )
+                );
+                result[lane] = (value + 1.0) * 0.5;
+            }
+
+            std::copy(result, result + size, noise + offset);
+        }
+    }
+
+    void Moisture::shade (const float_max_t u[], const float_max_t v[], unsigned count, Pigment::Color colors[]) const {
+
+        constexpr unsigned W = PerlinNoise::BATCH_SIZE;
+
+        float_max_t s[W], t[W], x[W], y[W], z[W], noise[W];
+
+        for (unsigned offset = 0; offset < count; offset += W) {
+
+            const unsigned size = std::min(count - offset, W);
+
+            for (unsigned i = 0; i < size; ++i) {
+                s[i] = wrap(u[offset + i]);
+                t[i] = wrap(v[offset + i]);
+                x[i] = s[i] * 5.0;
+                y[i] = t[i] * 5.0;
+                z[i] = 0.0;
+            }
+
+            this->noise.at(x, y, z, size, noise);
+
+            for (unsigned i = 0; i < size; ++i) {
+                const float_max_t value = band(s[i], noise[i]);
+                colors[offset + i] = value * this->color_1 + (-value + 1.0) * this->color_2;
+            }
+        }
+    }
+
+};
@@ -0,0 +1,173 @@
+#ifndef SRC_PIGMENTS_H_
+#define SRC_PIGMENTS_H_
+
+#include <cmath>
+#include <algorithm>
+#include "graphics/graphics.h"
+
+namespace RayTrace {
+
+    // Improved Perlin noise with every step written without branches so that the batch version maps onto vector
+    // registers. Its permutation is built the way Pigment::PerlinNoise::shuffle builds its own, so that both give
+    // the same noise for the same seed, which bench/pigments.cc checks.
+    class PerlinNoise {
+
+        // Permutation repeated twice, so that adding a coordinate to an entry never needs wrapping
+        int permutation[512];
+
+        static inline float_max_t fade (float_max_t t) { return t * t * t * (t * (t * 6.0 - 15.0) + 10.0); }
+        static inline float_max_t lerp (float_max_t t, float_max_t a, float_max_t b) { return a + t * (b - a); }
+
+        static inline float_max_t grad (int hash, float_max_t x, float_max_t y, float_max_t z) {
+            const int h = hash & 15;
+            const float_max_t
+                u = h < 8 ? x : y,
+                v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+            return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+        }
+
+    public:
+
+        static constexpr unsigned BATCH_SIZE = 8;
+
+        PerlinNoise (unsigned seed = 0) { this->shuffle(seed); }
+
+        // The numbers 0 to 255 in order, shuffled by std::shuffle with a std::default_random_engine seeded by seed
+        void shuffle (unsigned seed);
+
+        // Noise at a point, between 0 and 1
+        inline float_max_t at (float_max_t x, float_max_t y, float_max_t z) const {
+
+            const float_max_t fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+            const int X = static_cast<int>(fx) & 255, Y = static_cast<int>(fy) & 255, Z = static_cast<int>(fz) & 255;
+
+            x -= fx;
+            y -= fy;
+            z -= fz;
+
+            const int *p = this->permutation;
+            const int
+                A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z,
+                B = p[X + 1] + Y, BA = p[B] + Z, BB = p[B + 1] + Z;
+            const float_max_t u = fade(x), v = fade(y), w = fade(z);
+
+            const float_max_t noise = lerp(w,
+                lerp(v,
+                    lerp(u, grad(p[AA], x, y, z), grad(p[BA], x - 1.0, y, z)),
+                    lerp(u, grad(p[AB], x, y - 1.0, z), grad(p[BB], x - 1.0, y - 1.0, z))
+                ),
+                lerp(v,
+                    lerp(u, grad(p[AA + 1], x, y, z - 1.0), grad(p[BA + 1], x - 1.0, y, z - 1.0)),
+                    lerp(u, grad(p[AB + 1], x, y - 1.0, z - 1.0), grad(p[BB + 1], x - 1.0, y - 1.0, z - 1.0))
+                )
+            );
+
+            return (noise + 1.0) * 0.5;
+        }
+
+        // Noise at count points, BATCH_SIZE at a time
+        void at (const float_max_t x[], const float_max_t y[], const float_max_t z[], unsigned count, float_max_t noise[]) const;
+    };
+
+    // Pigment computed from the texture parameters divided by width and height. The shading is looked up statically
+    // on Derived, which must provide shade(u, v) and may provide a faster shade(u[], v[], count, colors[]).
+    template <typename Derived>
+    class Procedural : public Pigment::Texture {
+
+    protected:
+
+        float_max_t width, height;
+
+    public:
+
+        Procedural (float_max_t width, float_max_t height) : width(width), height(height) {}
+
+        Pigment::Color getColor (const Geometry::Vec<2> &param, const Geometry::Vec<3> &) const override final {
+            return static_cast<const Derived *>(this)->shade(param[0] / this->width, param[1] / this->height);
+        }
+
+        // Colors at count parameter pairs at once
+        void getColors (const float_max_t s[], const float_max_t t[], unsigned count, Pigment::Color colors[]) const {
+
+            float_max_t u[PerlinNoise::BATCH_SIZE], v[PerlinNoise::BATCH_SIZE];
+
+            for (unsigned offset = 0; offset < count; offset += PerlinNoise::BATCH_SIZE) {
+                const unsigned size = std::min(count - offset, PerlinNoise::BATCH_SIZE);
+                for (unsigned i = 0; i < size; ++i) {
+                    u[i] = s[offset + i] / this->width;
+                    v[i] = t[offset + i] / this->height;
+                }
+                static_cast<const Derived *>(this)->shade(u, v, size, colors + offset);
+            }
+        }
+
+        void shade (const float_max_t u[], const float_max_t v[], unsigned count, Pigment::Color colors[]) const {
+            for (unsigned i = 0; i < count; ++i) {
+                colors[i] = static_cast<const Derived *>(this)->shade(u[i], v[i]);
+            }
+        }
+    };
+
+    // Squares of two colors alternating along both parameters, blended on the lines between them
+    class Checker : public Procedural<Checker> {
+
+        Pigment::Color color_1, color_2, average;
+
+    public:
+
+        Checker (const Pigment::Color &color_1, const Pigment::Color &color_2, float_max_t size) :
+            Procedural<Checker>(size, size),
+            color_1(color_1),
+            color_2(color_2),
+            average((color_1 + color_2) * 0.5) {}
+
+        using Procedural<Checker>::shade;
+
+        inline Pigment::Color shade (float_max_t u, float_max_t v) const {
+
+            const float_max_t
+                s = Geometry::fract(u),
+                t = Geometry::fract(v);
+
+            if (Geometry::closeToZero(s) || Geometry::closeTo(s, 0.5) || Geometry::closeTo(s, 1.0) ||
+                Geometry::closeToZero(t) || Geometry::closeTo(t, 0.5) || Geometry::closeTo(t, 1.0)) {
+                return this->average;
+            }
+
+            const bool right = std::round(s) > 0.5, top = std::round(t) > 0.5;
+
+            return (top && right) || !(top || right) ? this->color_1 : this->color_2;
+        }
+    };
+
+    // Wavy bands between two colors, distorted by Perlin noise
+    class Moisture : public Procedural<Moisture> {
+
+        Pigment::Color color_1, color_2;
+        PerlinNoise noise;
+
+        static inline float_max_t wrap (float_max_t value) { return std::fmod(value, 500.0) + 500.0; }
+        static inline float_max_t band (float_max_t s, float_max_t noise) { return (1.0 + std::sin((s + noise * 0.5) * 50.0)) * 0.5; }
+
+    public:
+
+        Moisture (const Pigment::Color &color_1, const Pigment::Color &color_2, float_max_t size, unsigned seed) :
+            Procedural<Moisture>(size, size),
+            color_1(color_1),
+            color_2(color_2),
+            noise(seed) {}
+
+        inline Pigment::Color shade (float_max_t u, float_max_t v) const {
+            const float_max_t
+                s = wrap(u),
+                t = wrap(v),
+                value = band(s, this->noise.at(s * 5.0, t * 5.0, 0.0));
+            return value * this->color_1 + (-value + 1.0) * this->color_2;
+        }
+
+        void shade (const float_max_t u[], const float_max_t v[], unsigned count, Pigment::Color colors[]) const;
+    };
+
+};
+
+#endif
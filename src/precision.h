@@ -0,0 +1,42 @@
+#ifndef SRC_PRECISION_H_
+#define SRC_PRECISION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "graphics/graphics.h"
+
+namespace RayTrace {
+
+    // Precision of what the intersection loops stream through: hierarchy nodes, rays and packets, the primitive
+    // stores and mesh vertices. Building with RAYTRACE_FLOAT32 makes it float, which doubles the lanes of every
+    // vector loop over them. Shading and the library keep float_max_t.
+#ifdef RAYTRACE_FLOAT32
+    typedef float float_trace_t;
+#else
+    typedef float_max_t float_trace_t;
+#endif
+
+    // Nearest float_trace_t, values beyond its range taken as its largest ones. Branchless, since rays narrow every
+    // distance they compare nodes against.
+    inline float_trace_t Narrow (float_max_t value) {
+        if (sizeof(float_trace_t) < sizeof(float_max_t)) {
+            value = std::min<float_max_t>(std::max<float_max_t>(value, -std::numeric_limits<float_trace_t>::max()), std::numeric_limits<float_trace_t>::max());
+        }
+        return static_cast<float_trace_t>(value);
+    }
+
+    // Largest float_trace_t not above value and smallest not below it, so narrowed bounds still hold what they did
+    inline float_trace_t NarrowDown (float_max_t value) {
+        const float_trace_t narrow = Narrow(value);
+        return narrow > value ? std::nextafter(narrow, -std::numeric_limits<float_trace_t>::infinity()) : narrow;
+    }
+
+    inline float_trace_t NarrowUp (float_max_t value) {
+        const float_trace_t narrow = Narrow(value);
+        return narrow < value ? std::nextafter(narrow, std::numeric_limits<float_trace_t>::infinity()) : narrow;
+    }
+
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include <limits>
+#include "primitives.h"
+
+namespace RayTrace {
+
+    namespace {
+
+        constexpr float_trace_t NONE = std::numeric_limits<float_trace_t>::max();
+        constexpr float_trace_t MISS = std::numeric_limits<float_trace_t>::infinity();
+
+        // Picks the entering distance when it is ahead of the origin, the leaving one otherwise. Misses are never in front.
+        inline void pick (float_trace_t t_min, float_trace_t t_max, bool hit, float_max_t &distance, bool &front) {
+            const bool ahead = t_min > 0.0;
+            front = hit && ahead;
+            distance = !hit ? MISS : (ahead ? t_min : (t_max > 0.0 && t_max < NONE ? t_max : MISS));
+        }
+
+        // Narrows [t_min, t_max] to the part of the ray between the two planes of one box axis. Rays running
+        // along the planes are only kept when they start between them, edges included.
+        inline void slab (float_trace_t low, float_trace_t high, float_trace_t origin, float_trace_t direction, float_trace_t inverse, float_trace_t &t_min, float_trace_t &t_max) {
+            const bool parallel = std::abs(direction) <= 1e-12, between = origin >= low && origin <= high;
+            const float_trace_t
+                t_0 = parallel ? (between ? -NONE : NONE) : (low - origin) * inverse,
+                t_1 = parallel ? NONE : (high - origin) * inverse;
+            t_min = std::max(t_min, std::min(t_0, t_1));
+            t_max = std::min(t_max, std::max(t_0, t_1));
+        }
+
+        // Quarter discriminant of the ray against a sphere, from the offset o of the origin to the center. Taken as
+        // a (r^2 - |o - (b / a) d|^2) rather than b^2 - a c, which loses every digit of float_trace_t to cancellation
+        // once the sphere is small next to its distance.
+        inline float_trace_t discriminant (
+            float_trace_t ox,
+            float_trace_t oy,
+            float_trace_t oz,
+            float_trace_t dx,
+            float_trace_t dy,
+            float_trace_t dz,
+            float_trace_t a,
+            float_trace_t b,
+            float_trace_t radius
+        ) {
+            const float_trace_t
+                along = b / a,
+                fx = ox - along * dx,
+                fy = oy - along * dy,
+                fz = oz - along * dz;
+            return a * (radius * radius - (fx * fx + fy * fy + fz * fz));
+        }
+
+        void sphereBlock (const PrimitiveStore &store, unsigned offset, unsigned count, const BVH::Ray &ray, float_max_t distance[], bool front[]) {
+
+            const float_trace_t
+                *center_x = store.params[0].data() + offset,
+                *center_y = store.params[1].data() + offset,
+                *center_z = store.params[2].data() + offset,
+                *radius = store.params[3].data() + offset,
+                dx = ray.direction[0],
+                dy = ray.direction[1],
+                dz = ray.direction[2],
+                a = dx * dx + dy * dy + dz * dz;
+
+            #pragma omp simd
+            for (unsigned i = 0; i < count; ++i) {
+                const float_trace_t
+                    ox = ray.origin[0] - center_x[i],
+                    oy = ray.origin[1] - center_y[i],
+                    oz = ray.origin[2] - center_z[i],
+                    b = ox * dx + oy * dy + oz * dz,
+                    quarter = discriminant(ox, oy, oz, dx, dy, dz, a, b, radius[i]),
+                    root = std::sqrt(std::max<float_trace_t>(quarter, 0.0));
+                pick((-b - root) / a, (-b + root) / a, quarter >= 0.0, distance[i], front[i]);
+            }
+        }
+
+        void boxBlock (const PrimitiveStore &store, unsigned offset, unsigned count, const BVH::Ray &ray, float_max_t distance[], bool front[]) {
+
+            #pragma omp simd
+            for (unsigned i = 0; i < count; ++i) {
+                float_trace_t t_min = -NONE, t_max = NONE;
+                for (unsigned axis = 0; axis < 3; ++axis) {
+                    slab(store.params[axis][offset + i], store.params[axis + 3][offset + i], ray.origin[axis], ray.direction[axis], ray.inverse[axis], t_min, t_max);
+                }
+                pick(t_min, t_max, t_min <= t_max, distance[i], front[i]);
+            }
+        }
+    }
+
+    constexpr unsigned PrimitiveStore::BLOCK_SIZE;
+
+    void PrimitiveStore::build (
+        const std::vector<const Shape::Shape *> &shapes,
+        const std::vector<unsigned> &orders,
+        const std::vector<const ShapeInfo *> &infos,
+        const BVH *hierarchy
+    ) {
+
+        const unsigned fields = this->type == ShapeInfo::SPHERE ? 4 : 6;
+
+        std::vector<Bounds> bounds;
+
+        for (const ShapeInfo *info : infos) {
+            bounds.push_back(info->bounds);
+        }
+
+        if (hierarchy != nullptr && hierarchy->fits(bounds)) {
+            this->bvh = *hierarchy;
+        } else {
+            this->bvh.build(bounds, BLOCK_SIZE, BLOCK_SIZE);
+        }
+
+        for (unsigned i = 0; i < fields; ++i) {
+            this->params[i].clear();
+        }
+        this->shapes.clear();
+        this->orders.clear();
+
+        for (unsigned index : this->bvh.getIndices()) {
+            for (unsigned i = 0; i < fields; ++i) {
+                this->params[i].push_back(Narrow(infos[index]->params[i]));
+            }
+            this->shapes.push_back(shapes[index]);
+            this->orders.push_back(orders[index]);
+        }
+    }
+
+    void IntersectBlock (
+        const PrimitiveStore &store,
+        unsigned offset,
+        unsigned count,
+        const BVH::Ray &ray,
+        float_max_t distance[PrimitiveStore::BLOCK_SIZE],
+        bool front[PrimitiveStore::BLOCK_SIZE]
+    ) {
+        if (store.type == ShapeInfo::SPHERE) {
+            sphereBlock(store, offset, count, ray, distance, front);
+        } else {
+            boxBlock(store, offset, count, ray, distance, front);
+        }
+    }
+
+};
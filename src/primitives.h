@@ -0,0 +1,76 @@
+#ifndef SRC_PRIMITIVES_H_
+#define SRC_PRIMITIVES_H_
+
+#include <array>
+#include <vector>
+#include "graphics/graphics.h"
+#include "bvh.h"
+#include "materials.h"
+
+namespace RayTrace {
+
+    // What the loader knows about a shape besides the library object itself
+    struct ShapeInfo {
+
+        enum Type { GENERIC, SPHERE, BOX, CYLINDER, POLYHEDRON, MESH };
+
+        Type type = GENERIC;
+        Bounds bounds;
+
+        // Sphere: center and radius. Box: minimum and maximum corners. Cylinder: bottom, top and radius.
+        float_max_t params[7];
+
+        // Polyhedron faces as normal and d, the inside being where normal . point + d <= 0
+        std::vector<std::array<float_max_t, 4>> faces;
+
+        // Shading attributes known to be constant at load time, for plain shapes with a baked surface or solid pigment
+        bool baked_material = false, baked_pigment = false;
+        Material material;
+        Pigment::Color pigment;
+
+        // Only there for instances to refer to, and not rendered itself
+        bool prototype = false;
+        // Holds an instance that no transform has moved off the shape it shares
+        bool instance = false;
+    };
+
+    // Plain spheres or boxes packed one coordinate per array, in the leaf order of their own BVH so that
+    // every leaf is a contiguous block that one ray is tested against with a single vector loop
+    struct PrimitiveStore {
+
+        static constexpr unsigned BLOCK_SIZE = 8;
+
+        ShapeInfo::Type type;
+        // Sphere: center x, y, z and radius. Box: minimum x, y, z and maximum x, y, z.
+        std::vector<float_trace_t> params[6];
+        std::vector<const Shape::Shape *> shapes;
+        // Position of each shape in the scene file
+        std::vector<unsigned> orders;
+        BVH bvh;
+
+        PrimitiveStore (ShapeInfo::Type type) : type(type) {}
+
+        void build (
+            const std::vector<const Shape::Shape *> &shapes,
+            const std::vector<unsigned> &orders,
+            const std::vector<const ShapeInfo *> &infos,
+            const BVH *hierarchy = nullptr
+        );
+
+        inline bool empty () const { return this->shapes.empty(); }
+    };
+
+    // Writes the distance to every shape of the block [offset, offset + count) that lies ahead of the ray origin
+    // (infinity when there is none), and whether the ray is entering the shape there
+    void IntersectBlock (
+        const PrimitiveStore &store,
+        unsigned offset,
+        unsigned count,
+        const BVH::Ray &ray,
+        float_max_t distance[PrimitiveStore::BLOCK_SIZE],
+        bool front[PrimitiveStore::BLOCK_SIZE]
+    );
+
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SRC_RANDOM_H_
+#define SRC_RANDOM_H_
+
+#include <cstdint>
+#include "graphics/graphics.h"
+
+namespace RayTrace {
+
+    // Mixes value into key after the finalizer of SplitMix64, so that keys differing by a single bit look unrelated
+    inline std::uint64_t Mix (std::uint64_t key, std::uint64_t value) {
+        key += 0x9e3779b97f4a7c15ULL * (value + 1);
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+        return key ^ (key >> 31);
+    }
+
+    // Number in [0, 1) made from the top 53 bits of a mixed key
+    inline float_max_t Uniform (std::uint64_t key) {
+        return (key >> 11) / 9007199254740992.0;
+    }
+
+};
+
+#endif
@@ -1,51 +1,504 @@
+#include <algorithm>
+#include <atomic>
 #include "raytrace.h"
 
 namespace RayTrace {
 
-    bool Collision (
-        const Geometry::Line &line,
+    namespace {
+
+        // Decides whether a branch carrying the given share of the pixel is traced, and by how much its result
+        // must be scaled so that the branches kept by Russian roulette make up for the ones dropped. The number
+        // roulette draws comes from the key of the branch, so the same render always keeps the same branches.
+        inline bool Survives (const Pruning &pruning, float_max_t weight, std::uint64_t key, float_max_t &scale) {
+
+            scale = 1.0;
+
+            if (weight >= pruning.threshold) {
+                return true;
+            }
+            if (!pruning.roulette) {
+                return false;
+            }
+
+            const float_max_t probability = weight / pruning.threshold;
+
+            if (Uniform(key) < probability) {
+                scale = 1.0 / probability;
+                return true;
+            }
+            return false;
+        }
+
+        // Kinds of branch below a hit, mixed into the key of the frame to make the keys of its branches and of the
+        // lights sampled at it
+        enum Branch { REFLECT, TRANSMIT, LIGHTS };
+
+        // Light samples looked at before deciding whether a point lies in a penumbra
+        constexpr unsigned MAX_PROBES = 5;
+
+        // One pending ray of the tree below a camera ray
+        struct Frame {
+            Geometry::Line line;
+            // What the color found along the line is multiplied by before it reaches the pixel
+            float_max_t factor;
+            // Share of the pixel the ray stands for, as pruning sees it
+            float_max_t weight;
+            unsigned jumps, depth;
+            // Distance from the camera along the rays above, which widens the footprint of textures
+            float_max_t travelled;
+            // Hash of the pixel, the sample and the branch taken at every depth down to the ray
+            std::uint64_t key;
+        };
+
+        // Rays waiting to be traced by the calling thread. It is kept between calls, so it only allocates
+        // while growing to the deepest tree the thread has seen.
+        std::vector<Frame> &Stack () {
+            static thread_local std::vector<Frame> stack;
+            return stack;
+        }
+
+        std::atomic<unsigned long long> shadow_queries(0), shadow_blocked(0), shadow_hits(0);
+        std::atomic<std::uint64_t> generations(0);
+
+        // Shape that blocked each light deviation the last time the calling thread looked, indexed by
+        // (depth * lights + light) * deviations + deviation. Neighbouring pixels are usually shadowed by the same
+        // shape, and the depth keeps reflections from evicting what the camera rays found.
+        struct ShadowCache {
+
+            static constexpr unsigned DEPTHS = 4;
+
+            std::vector<const Shape::Shape *> occluders;
+            // ShapeSet the occluders belong to
+            std::uint64_t generation = 0;
+            unsigned long long queries = 0, blocked = 0, hits = 0;
+
+            // Counters are only added to the totals when the thread is done with a batch of camera rays, which
+            // keeps threads from fighting over the shared cache line
+            void flush () {
+                shadow_queries.fetch_add(this->queries, std::memory_order_relaxed);
+                shadow_blocked.fetch_add(this->blocked, std::memory_order_relaxed);
+                shadow_hits.fetch_add(this->hits, std::memory_order_relaxed);
+                this->queries = this->blocked = this->hits = 0;
+            }
+        };
+
+        ShadowCache &Shadows () {
+            static thread_local ShadowCache cache;
+            return cache;
+        }
+
+        // How far secondary rays start off the surface. Hits found in float_trace_t are a few of its epsilons off,
+        // relative to the coordinates involved, which outgrows Geometry::EPSILON away from the origin.
+        inline float_max_t Offset (const Geometry::Line &line, const Geometry::Vec<3> &point) {
+            const Geometry::Vec<3> &origin = line.at(0.0);
+            float_max_t magnitude = 0.0;
+            for (unsigned i = 0; i < 3; ++i) {
+                magnitude = std::max({ magnitude, std::abs(origin[i]), std::abs(point[i]) });
+            }
+            return std::max(Geometry::EPSILON, magnitude * 32.0 * std::numeric_limits<float_trace_t>::epsilon());
+        }
+
+        // Whether the shape crosses the line between its origin and distance
+        inline bool Blocks (const Shape::Shape *shape, const Geometry::Line &line, float_max_t distance) {
+
+            float_max_t t_min, t_max;
+            bool inside_min, inside_max;
+            Geometry::Vec<3> normal_min, normal_max;
+            Pigment::Color color_min, color_max;
+            Light::Material material_min, material_max;
+
+            return shape->intersectLine(line, t_min, t_max, false, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max) && (
+                (t_min > 0.0 && t_min < distance) ||
+                (t_min <= 0.0 && t_max > 0.0 && t_max < distance)
+            );
+        }
+
+        // Places a hit found in float_trace_t again in float_max_t, so that shading sees it as exactly as a wide build
+        // would, and tells whether it still holds there. Mesh hits are kept as they are, the offsets of the rays
+        // leaving them covering their error.
+        inline bool Refine (const Geometry::Line &line, const ShapeSet &shapes, Hit &hit) {
+
+            if (sizeof(float_trace_t) == sizeof(float_max_t) || hit.shape == nullptr) {
+                return true;
+            }
+
+            const ShapeInfo::Type type = shapes.getInfo(hit.order).type;
+            if (type == ShapeInfo::GENERIC || type == ShapeInfo::MESH) {
+                return true;
+            }
+
+            float_max_t t_min, t_max;
+            bool inside_min, inside_max;
+            Geometry::Vec<3> normal_min, normal_max;
+            Pigment::Color color_min, color_max;
+            Light::Material material_min, material_max;
+
+            if (hit.shape->intersectLine(line, t_min, t_max, false, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max)) {
+                if (t_min > 0.0) {
+                    hit.distance = t_min;
+                    hit.front = true;
+                    return true;
+                } else if (t_max > 0.0) {
+                    hit.distance = t_max;
+                    hit.front = false;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Finds the face of a box, cylinder or polyhedron that a hit lies on, as the one the point is closest to. Mesh
+        // hits already carry their triangle.
+        inline void Locate (const Geometry::Line &line, const ShapeSet &shapes, Hit &hit) {
+
+            if (hit.shape == nullptr || shapes.getInfo(hit.order).type == ShapeInfo::MESH) {
+                return;
+            }
+
+            const ShapeInfo &info = shapes.getInfo(hit.order);
+            const Geometry::Vec<3> &point = line.at(hit.distance);
+
+            hit.face = 0;
+
+            if (info.type == ShapeInfo::BOX) {
+                // Relative to the size of the box along each axis
+                unsigned axis = 0;
+                float_max_t offsets[3];
+                for (unsigned i = 0; i < 3; ++i) {
+                    const float_max_t half = (info.params[i + 3] - info.params[i]) * 0.5;
+                    offsets[i] = (point[i] - (info.params[i] + half)) / (half > 0.0 ? half : 1.0);
+                    axis = std::abs(offsets[i]) > std::abs(offsets[axis]) ? i : axis;
+                }
+                hit.face = 2 * axis + (offsets[axis] < 0.0 ? 0 : 1);
+            } else if (info.type == ShapeInfo::CYLINDER) {
+                const Geometry::Vec<3>
+                    bottom({ info.params[0], info.params[1], info.params[2] }),
+                    axis = Geometry::Vec<3>({ info.params[3], info.params[4], info.params[5] }) - bottom,
+                    offset = point - bottom;
+                const float_max_t
+                    length = axis.length(),
+                    height = offset.dot(axis) / length,
+                    radial = (offset - axis * (height / length)).length(),
+                    distances[3] = { std::abs(radial - std::abs(info.params[6])), std::abs(height), std::abs(height - length) };
+                hit.face = std::min_element(distances, distances + 3) - distances;
+            } else if (info.type == ShapeInfo::POLYHEDRON) {
+                // Every face has the point on or behind it
+                float_max_t nearest = -std::numeric_limits<float_max_t>::infinity();
+                for (unsigned i = 0; i < info.faces.size(); ++i) {
+                    const std::array<float_max_t, 4> &face = info.faces[i];
+                    const float_max_t offset = (face[0] * point[0] + face[1] * point[1] + face[2] * point[2] + face[3]) /
+                        std::sqrt(face[0] * face[0] + face[1] * face[1] + face[2] * face[2]);
+                    if (offset > nearest) {
+                        nearest = offset;
+                        hit.face = i;
+                    }
+                }
+            }
+        }
+
+        // Keeps the closest hit, the shape that comes first in the scene file winning ties
+        inline void Record (Hit &hit, const Shape::Shape *shape, unsigned order, float_max_t distance, bool front) {
+            if (distance < hit.distance || (distance == hit.distance && hit.shape != nullptr && order < hit.order)) {
+                hit = { shape, order, distance, front };
+            }
+        }
+
+        inline void Record (Hit &hit, const Shape::Shape *shape, unsigned order, const Mesh::Hit &mesh_hit) {
+            if (mesh_hit.distance < hit.distance || (mesh_hit.distance == hit.distance && hit.shape != nullptr && order < hit.order)) {
+                hit = { shape, order, mesh_hit.distance, mesh_hit.front, mesh_hit.triangle, mesh_hit.u, mesh_hit.v };
+            }
+        }
+    }
+
+    ShapeSet::ShapeSet (
         const std::vector<Shape::Shape *> &shapes,
-        float_max_t &distance,
-        bool get_info,
-        Geometry::Vec<3> &normal,
-        bool &inside,
-        Pigment::Color &pigment,
-        Light::Material &material
+        const std::vector<ShapeInfo> &infos,
+        const std::vector<BVH> &hierarchies
+    ) :
+        spheres(ShapeInfo::SPHERE), boxes(ShapeInfo::BOX), infos(infos), generation(generations.fetch_add(1) + 1) {
+
+        std::vector<Entry> candidates;
+        std::vector<Bounds> candidate_bounds;
+        std::vector<const Shape::Shape *> sphere_shapes, box_shapes;
+        std::vector<unsigned> sphere_orders, box_orders;
+        std::vector<const ShapeInfo *> sphere_infos, box_infos;
+
+        for (unsigned i = 0; i < shapes.size(); ++i) {
+            if (shapes[i] != nullptr && !infos[i].prototype) {
+                if (infos[i].type == ShapeInfo::SPHERE && infos[i].bounds.isFinite()) {
+                    sphere_shapes.push_back(shapes[i]);
+                    sphere_orders.push_back(i);
+                    sphere_infos.push_back(&infos[i]);
+                } else if (infos[i].type == ShapeInfo::BOX && infos[i].bounds.isFinite()) {
+                    box_shapes.push_back(shapes[i]);
+                    box_orders.push_back(i);
+                    box_infos.push_back(&infos[i]);
+                } else if (infos[i].bounds.isFinite()) {
+                    candidates.push_back({ shapes[i], i, infos[i] });
+                    candidate_bounds.push_back(infos[i].bounds);
+                } else if (!infos[i].bounds.isEmpty()) {
+                    this->unbounded.push_back({ shapes[i], i, infos[i] });
+                }
+            }
+        }
+
+        const bool prebuilt = hierarchies.size() == 3;
+
+        if (prebuilt && hierarchies[0].fits(candidate_bounds)) {
+            this->bvh = hierarchies[0];
+        } else {
+            this->bvh.build(candidate_bounds);
+        }
+
+        for (unsigned index : this->bvh.getIndices()) {
+            this->bounded.push_back(candidates[index]);
+        }
+
+        this->spheres.build(sphere_shapes, sphere_orders, sphere_infos, prebuilt ? &hierarchies[1] : nullptr);
+        this->boxes.build(box_shapes, box_orders, box_infos, prebuilt ? &hierarchies[2] : nullptr);
+    }
+
+    bool Intersect (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        Hit &hit
     ) {
 
-        bool best_min, inside_min, inside_max;
+        bool inside_min, inside_max;
         float_max_t t_min, t_max;
         Geometry::Vec<3> normal_min, normal_max;
         Pigment::Color color_min, color_max;
         Light::Material material_min, material_max;
-        const Shape::Shape *best = nullptr;
 
-        for (const Shape::Shape *shape : shapes) {
+        float_max_t distance[PrimitiveStore::BLOCK_SIZE];
+        bool front[PrimitiveStore::BLOCK_SIZE];
 
-            if (shape->intersectLine(line, t_min, t_max, false, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max)) {
-                if (t_min > 0.0) {
-                    if (t_min < distance) {
-                        distance = t_min;
-                        best = shape;
-                        best_min = true;
+        const BVH::Ray ray(line);
+        const float_max_t limit = hit.distance;
+
+        // Spheres and boxes that the ray grazes in float_trace_t but misses in float_max_t, looked past when searching again
+        std::vector<const Shape::Shape *> rejected;
+
+        while (true) {
+
+            hit.shape = nullptr;
+            hit.distance = limit;
+
+            shapes.traverseBlocks(ray, hit.distance, [ & ] (const PrimitiveStore &store, unsigned offset, unsigned count) {
+                IntersectBlock(store, offset, count, ray, distance, front);
+                for (unsigned i = 0; i < count; ++i) {
+                    if (rejected.empty() || std::find(rejected.begin(), rejected.end(), store.shapes[offset + i]) == rejected.end()) {
+                        Record(hit, store.shapes[offset + i], store.orders[offset + i], distance[i], front[i]);
                     }
-                } else if (t_max > 0.0) {
-                    if (t_max < distance) {
-                        distance = t_max;
-                        best = shape;
-                        best_min = false;
+                }
+                return false;
+            });
+
+            shapes.traverse(ray, hit.distance, [ & ] (const Shape::Shape *shape, unsigned order) {
+
+                if (shapes.getInfo(order).type == ShapeInfo::MESH) {
+                    float_max_t distance = hit.distance;
+                    Mesh::Hit mesh_hit;
+                    if (static_cast<const Mesh *>(shape)->intersect(ray, distance, mesh_hit)) {
+                        Record(hit, shape, order, mesh_hit);
+                    }
+                } else if (shape->intersectLine(line, t_min, t_max, false, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max)) {
+                    if (t_min > 0.0) {
+                        Record(hit, shape, order, t_min, true);
+                    } else if (t_max > 0.0) {
+                        Record(hit, shape, order, t_max, false);
                     }
                 }
+                return false;
+            });
+
+            if (Refine(line, shapes, hit)) {
+                Locate(line, shapes, hit);
+                return hit.shape != nullptr;
             }
+
+            rejected.push_back(hit.shape);
         }
+    }
 
-        if (best != nullptr) {
-            if (get_info) {
-                if (best_min) {
-                    best->intersectLine(line, t_min, t_max, true, normal, normal_max, inside, inside_max, pigment, color_max, material, material_max);
+    void Intersect (
+        const Geometry::Line *lines,
+        unsigned count,
+        const ShapeSet &shapes,
+        Hit *hits
+    ) {
+
+        constexpr unsigned W = BVH::PACKET_SIZE;
+
+        const BVH::Packet packet(lines, count);
+
+        bool inside_min, inside_max;
+        float_max_t t_min, t_max, best[W], limit[W];
+        Geometry::Vec<3> normal_min, normal_max;
+        Pigment::Color color_min, color_max;
+        Light::Material material_min, material_max;
+
+        float_max_t block_distance[PrimitiveStore::BLOCK_SIZE];
+        bool block_front[PrimitiveStore::BLOCK_SIZE];
+
+        BVH::Ray rays[W];
+
+        for (unsigned lane = 0; lane < W; ++lane) {
+            best[lane] = limit[lane] = lane < count ? hits[lane].distance : 0.0;
+            if (lane < count) {
+                hits[lane].shape = nullptr;
+                rays[lane] = BVH::Ray(lines[lane]);
+            }
+        }
+
+        shapes.traverseBlocks(packet, best, [ & ] (const PrimitiveStore &store, unsigned offset, unsigned block_count) {
+            for (unsigned lane = 0; lane < count; ++lane) {
+                IntersectBlock(store, offset, block_count, rays[lane], block_distance, block_front);
+                for (unsigned i = 0; i < block_count; ++i) {
+                    Record(hits[lane], store.shapes[offset + i], store.orders[offset + i], block_distance[i], block_front[i]);
+                }
+                best[lane] = hits[lane].distance;
+            }
+        });
+
+        shapes.traverse(packet, best, [ & ] (const ShapeSet::Entry &entry) {
+
+            if (entry.info.type == ShapeInfo::MESH) {
+                for (unsigned lane = 0; lane < count; ++lane) {
+                    Mesh::Hit mesh_hit;
+                    float_max_t limit = best[lane];
+                    if (static_cast<const Mesh *>(entry.shape)->intersect(rays[lane], limit, mesh_hit)) {
+                        Record(hits[lane], entry.shape, entry.order, mesh_hit);
+                        best[lane] = hits[lane].distance;
+                    }
+                }
+                return;
+            }
+
+            // Every lane goes through the library, as single rays do, so that both find the very same hits
+            for (unsigned lane = 0; lane < count; ++lane) {
+                if (entry.shape->intersectLine(lines[lane], t_min, t_max, false, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max)) {
+                    if (t_min > 0.0) {
+                        Record(hits[lane], entry.shape, entry.order, t_min, true);
+                    } else if (t_max > 0.0) {
+                        Record(hits[lane], entry.shape, entry.order, t_max, false);
+                    }
+                }
+                best[lane] = hits[lane].distance;
+            }
+        });
+
+        // Lanes whose hit does not hold up are searched again on their own
+        for (unsigned lane = 0; lane < count; ++lane) {
+            if (Refine(lines[lane], shapes, hits[lane])) {
+                Locate(lines[lane], shapes, hits[lane]);
+            } else {
+                hits[lane].distance = limit[lane];
+                Intersect(lines[lane], shapes, hits[lane]);
+            }
+        }
+    }
+
+    void Shade (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        const Hit &hit,
+        Geometry::Vec<3> &normal,
+        bool &inside,
+        Pigment::Color &pigment,
+        Material &material
+    ) {
+
+        const ShapeInfo &info = shapes.getInfo(hit.order);
+
+        // Normals face the ray: outwards where it enters the shape, inwards where it leaves
+        if (info.baked_material && info.baked_pigment && info.type != ShapeInfo::GENERIC && info.type != ShapeInfo::MESH) {
+
+            const Geometry::Vec<3> &point = line.at(hit.distance);
+            const float_max_t side = hit.front ? 1.0 : -1.0;
+
+            if (info.type == ShapeInfo::SPHERE) {
+                normal = Geometry::Vec<3>({ point[0] - info.params[0], point[1] - info.params[1], point[2] - info.params[2] }) * (side / info.params[3]);
+            } else if (info.type == ShapeInfo::BOX) {
+                normal = Geometry::Vec<3>({ 0.0, 0.0, 0.0 });
+                normal[hit.face / 2] = hit.face % 2 == 0 ? -side : side;
+            } else if (info.type == ShapeInfo::CYLINDER) {
+                const Geometry::Vec<3>
+                    bottom({ info.params[0], info.params[1], info.params[2] }),
+                    axis = (Geometry::Vec<3>({ info.params[3], info.params[4], info.params[5] }) - bottom).normalized();
+                if (hit.face == 0) {
+                    const Geometry::Vec<3> offset = point - bottom;
+                    normal = (offset - axis * offset.dot(axis)).normalized() * side;
                 } else {
-                    best->intersectLine(line, t_min, t_max, true, normal_min, normal, inside_min, inside, color_min, pigment, material_min, material);
+                    normal = axis * (hit.face == 1 ? -side : side);
                 }
+            } else {
+                // As long as the library gives it, which is not normalized for faces not given with unit normals
+                const std::array<float_max_t, 4> &face = info.faces[hit.face];
+                normal = Geometry::Vec<3>({ face[0], face[1], face[2] }) * side;
+            }
+
+            inside = !hit.front;
+            pigment = info.pigment;
+            material = info.material;
+            return;
+        }
+
+        // Meshes are shaded from the triangle and barycentric coordinates of the hit, without searching them again
+        if (info.type == ShapeInfo::MESH) {
+
+            const Mesh &mesh = *static_cast<const Mesh *>(hit.shape);
+            const Mesh::Hit mesh_hit = { hit.distance, hit.face, hit.u, hit.v, hit.front };
+            const Geometry::Vec<3> outward = mesh.getNormal(hit.face);
+
+            normal = outward * ((hit.front ? 1.0 : -1.0) / outward.length());
+            inside = !hit.front;
+            pigment = mesh.colorAt(mesh_hit, line.at(hit.distance));
+
+            if (info.baked_material) {
+                material = info.material;
+            } else {
+                Light::Material found;
+                mesh.materialAt(mesh_hit, found);
+                material = Material(found);
+            }
+            return;
+        }
+
+        bool inside_other;
+        float_max_t t_min, t_max;
+        Geometry::Vec<3> normal_other;
+        Pigment::Color color_other;
+        Light::Material found, found_other;
+
+        if (hit.front) {
+            hit.shape->intersectLine(line, t_min, t_max, true, normal, normal_other, inside, inside_other, pigment, color_other, found, found_other);
+        } else {
+            hit.shape->intersectLine(line, t_min, t_max, true, normal_other, normal, inside_other, inside, color_other, pigment, found_other, found);
+        }
+
+        material = info.baked_material ? info.material : Material(found);
+    }
+
+    bool Collision (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        float_max_t &distance,
+        bool get_info,
+        Geometry::Vec<3> &normal,
+        bool &inside,
+        Pigment::Color &pigment,
+        Material &material
+    ) {
+
+        Hit hit;
+        hit.distance = distance;
+
+        if (Intersect(line, shapes, hit)) {
+            distance = hit.distance;
+            if (get_info) {
+                Shade(line, shapes, hit, normal, inside, pigment, material);
             }
             return true;
         }
@@ -53,152 +506,368 @@ namespace RayTrace {
         return false;
     }
 
+    bool Occluded (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        float_max_t distance,
+        const Shape::Shape **occluder
+    ) {
+
+        float_max_t block_distance[PrimitiveStore::BLOCK_SIZE];
+        bool block_front[PrimitiveStore::BLOCK_SIZE];
+
+        const BVH::Ray ray(line);
+
+        const bool blocked = shapes.traverseBlocks(ray, distance, [ & ] (const PrimitiveStore &store, unsigned offset, unsigned count) {
+            IntersectBlock(store, offset, count, ray, block_distance, block_front);
+            for (unsigned i = 0; i < count; ++i) {
+                if (block_distance[i] < distance) {
+                    if (occluder != nullptr) {
+                        *occluder = store.shapes[offset + i];
+                    }
+                    return true;
+                }
+            }
+            return false;
+        });
+
+        if (blocked) {
+            return true;
+        }
+
+        if (occluder != nullptr) {
+            *occluder = nullptr;
+        }
+
+        return shapes.traverse(ray, distance, [ & ] (const Shape::Shape *shape, unsigned order) {
+            const bool blocks = shapes.getInfo(order).type == ShapeInfo::MESH ?
+                static_cast<const Mesh *>(shape)->occludes(ray, distance) :
+                Blocks(shape, line, distance);
+            if (blocks) {
+                if (occluder != nullptr) {
+                    *occluder = shape;
+                }
+                return true;
+            }
+            return false;
+        });
+    }
+
+    void FlushShadowCacheStats () {
+        Shadows().flush();
+    }
+
+    ShadowCacheStats GetShadowCacheStats () {
+        return { shadow_queries.load(), shadow_blocked.load(), shadow_hits.load() };
+    }
+
     Pigment::Color Trace (
         const Geometry::Line &line,
-        const std::vector<Shape::Shape *> &shapes,
+        const ShapeSet &shapes,
+        Pigment::Color ambient,
+        const LightSet &lights,
+        const std::vector<Geometry::Vec<2>> &light_deviations,
+        const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &reflect_deviations,
+        const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &transmit_deviations,
+        Pigment::Color color,
+        unsigned jumps,
+        const Pruning &pruning,
+        const ShadowSampling &sampling,
+        float_max_t weight,
+        unsigned depth,
+        float_max_t spread,
+        std::uint64_t seed
+    ) {
+
+        Hit hit;
+
+        Intersect(line, shapes, hit);
+
+        return Trace(
+            line, hit, shapes, ambient, lights,
+            light_deviations, reflect_deviations, transmit_deviations,
+            color, jumps, pruning, sampling, weight, depth, spread, seed
+        );
+    }
+
+    Pigment::Color Trace (
+        const Geometry::Line &line,
+        const Hit &hit,
+        const ShapeSet &shapes,
         Pigment::Color ambient,
-        const std::vector<Light::Light *> &lights,
+        const LightSet &lights,
         const std::vector<Geometry::Vec<2>> &light_deviations,
         const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &reflect_deviations,
         const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &transmit_deviations,
         Pigment::Color color,
-        unsigned jumps
+        unsigned jumps,
+        const Pruning &pruning,
+        const ShadowSampling &sampling,
+        float_max_t weight,
+        unsigned depth,
+        float_max_t spread,
+        std::uint64_t seed
     ) {
 
-        float_max_t distance = std::numeric_limits<float_max_t>::infinity();
-        Geometry::Vec<3> normal;
-        Pigment::Color pigment;
-        Light::Material material;
-        bool inside;
+        // The color of a ray is its local shading plus a weighted sum of the colors of its reflected and transmitted
+        // rays, so the whole tree adds up to the local shading of every ray times the product of the weights above it.
+        // Rays are therefore handled one at a time from a stack instead of by recursion.
+        std::vector<Frame> &stack = Stack();
+        ShadowCache &shadows = Shadows();
+
+        // Central sample and the samples furthest out along both diagonals of the light, tested first when
+        // shadows are adaptive
+        unsigned probes[MAX_PROBES], probe_count = 0;
+
+        if (sampling.adaptive && light_deviations.size() > MAX_PROBES) {
+            auto sum = [ & ] (unsigned i) { return light_deviations[i][0] + light_deviations[i][1]; };
+            auto difference = [ & ] (unsigned i) { return light_deviations[i][0] - light_deviations[i][1]; };
+
+            unsigned extremes[4] = { 0, 0, 0, 0 };
+            for (unsigned i = 1; i < light_deviations.size(); ++i) {
+                extremes[0] = sum(i) < sum(extremes[0]) ? i : extremes[0];
+                extremes[1] = sum(i) > sum(extremes[1]) ? i : extremes[1];
+                extremes[2] = difference(i) < difference(extremes[2]) ? i : extremes[2];
+                extremes[3] = difference(i) > difference(extremes[3]) ? i : extremes[3];
+            }
+            probes[probe_count++] = 0;
+            for (unsigned extreme : extremes) {
+                if (std::find(probes, probes + probe_count, extreme) == probes + probe_count) {
+                    probes[probe_count++] = extreme;
+                }
+            }
+        }
+
+        // Occluders found in another set of shapes may have been freed along with their scene
+        if (shadows.generation != shapes.getGeneration()) {
+            std::fill(shadows.occluders.begin(), shadows.occluders.end(), nullptr);
+            shadows.generation = shapes.getGeneration();
+        }
+
+        if (shadows.occluders.size() < ShadowCache::DEPTHS * lights.size() * light_deviations.size()) {
+            shadows.occluders.resize(ShadowCache::DEPTHS * lights.size() * light_deviations.size(), nullptr);
+        }
+
+        const std::size_t base = stack.size();
+
+        Pigment::Color result(0.0, 0.0, 0.0);
+        Hit current = hit;
 
-        if (Collision(line, shapes, distance, true, normal, inside, pigment, material)) {
+        stack.push_back({ line, 1.0, weight, jumps, depth, 0.0, seed });
 
-            const Geometry::Vec<3> &point = line.at(distance);
+        for (bool first = true; stack.size() > base; first = false) {
 
-            Pigment::Color
-                reflected(0.0, 0.0, 0.0),
-                transmitted(0.0, 0.0, 0.0),
-                accumulated(0.0, 0.0, 0.0);
+            const Frame frame = stack.back();
+            stack.pop_back();
+
+            if (!first) {
+                current = Hit();
+                Intersect(frame.line, shapes, current);
+            }
+
+            if (current.shape == nullptr) {
+                result += color * frame.factor;
+                continue;
+            }
+
+            Geometry::Vec<3> normal;
+            Pigment::Color pigment;
+            Material material;
+            bool inside;
+
+            Footprint() = spread * (frame.travelled + current.distance);
+
+            Shade(frame.line, shapes, current, normal, inside, pigment, material);
+
+            const Geometry::Line &ray = frame.line;
+            const Geometry::Vec<3> &point = ray.at(current.distance);
+            const float_max_t offset = Offset(ray, point);
+
+            Pigment::Color accumulated(0.0, 0.0, 0.0);
 
             normal += material.getNormal();
 
-            if (jumps > 0) {
+            // Past the distribution depth only the first, central, entry of every deviation set is used
+            const bool distribute = frame.depth < pruning.distribute_depth;
+
+            const unsigned
+                reflect_count = distribute ? reflect_deviations.size() : 1,
+                transmit_count = distribute ? transmit_deviations.size() : 1,
+                light_count = distribute ? light_deviations.size() : 1;
 
-                if (material.getReflect() > Geometry::EPSILON) {
+            float_max_t scale;
+
+            if (frame.jumps > 0) {
+
+                if (material.getReflect() > Geometry::EPSILON && Survives(pruning, frame.weight * material.getReflect(), Mix(frame.key, REFLECT), scale)) {
                     const Geometry::Vec<3>
-                        reflect = (-2.0 * normal.dot(line.getDirection()) * normal + line.getDirection()).normalized(),
+                        reflect = (-2.0 * normal.dot(ray.getDirection()) * normal + ray.getDirection()).normalized(),
                         up_dir = reflect.perpendicular().normalized(),
                         right_dir = reflect.cross(up_dir).normalized(),
                         hit_point = point + reflect * 5.0;
 
-                    Pigment::Color reflect_accumulated(0.0, 0.0, 0.0);
-
                     float_max_t total_weight = 0.0;
 
-                    for (const auto &deviation : reflect_deviations) {
-                        const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
-        			    reflect_accumulated += Trace(
-                            Geometry::Line(point + dir * Geometry::EPSILON, dir),
-                            shapes, ambient, lights,
-                            light_deviations, reflect_deviations, transmit_deviations,
-                            color, jumps - 1
-                        ) * deviation.second;
-                        total_weight += deviation.second;
+                    for (unsigned i = 0; i < reflect_count; ++i) {
+                        total_weight += reflect_deviations[i].second;
                     }
 
-                    reflected += (reflect_accumulated / total_weight) * material.getReflect();
+                    for (unsigned i = 0; i < reflect_count; ++i) {
+                        const auto &deviation = reflect_deviations[i];
+                        const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
+                        stack.push_back({
+                            Geometry::Line(point + dir * offset, dir),
+                            frame.factor * material.getReflect() * scale * deviation.second / total_weight,
+                            frame.weight * material.getReflect() * scale,
+                            frame.jumps - 1,
+                            frame.depth + 1,
+                            frame.travelled + current.distance,
+                            Mix(Mix(frame.key, REFLECT), i)
+                        });
+                    }
                 }
 
-                if (material.getTransmit() > Geometry::EPSILON) {
+                if (material.getTransmit() > Geometry::EPSILON && Survives(pruning, frame.weight * material.getTransmit(), Mix(frame.key, TRANSMIT), scale)) {
                     const float_max_t
                         nr = inside ? material.getIOR() : (1.0 / material.getIOR()),
-                        ndl = normal.dot(-line.getDirection()),
+                        ndl = normal.dot(-ray.getDirection()),
                         root = 1.0 - (nr * nr) * (1.0 - (ndl * ndl));
                     if (root >= 0.0) {
                         const Geometry::Vec<3>
-                            transmit = ((nr * ndl - std::sqrt(root)) * normal - nr * (-line.getDirection())).normalized(),
+                            transmit = ((nr * ndl - std::sqrt(root)) * normal - nr * (-ray.getDirection())).normalized(),
                             up_dir = transmit.perpendicular().normalized(),
                             right_dir = transmit.cross(up_dir).normalized(),
                             hit_point = point + transmit * 5.0;
 
-                        Pigment::Color transmit_accumulated(0.0, 0.0, 0.0);
-
                         float_max_t total_weight = 0.0;
 
-                        for (const auto &deviation : transmit_deviations) {
-                            const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
-            			    transmit_accumulated += Trace(
-                                Geometry::Line(point + dir * Geometry::EPSILON, dir),
-                                shapes, ambient, lights,
-                                light_deviations, reflect_deviations, transmit_deviations,
-                                color, jumps - 1
-                            ) * deviation.second;
-                            total_weight += deviation.second;
+                        for (unsigned i = 0; i < transmit_count; ++i) {
+                            total_weight += transmit_deviations[i].second;
                         }
 
-                        transmitted += (transmit_accumulated / total_weight) * material.getTransmit();
+                        for (unsigned i = 0; i < transmit_count; ++i) {
+                            const auto &deviation = transmit_deviations[i];
+                            const Geometry::Vec<3> dir = ((hit_point + deviation.first[0] * right_dir + deviation.first[1] * up_dir) - point).normalized();
+                            stack.push_back({
+                                Geometry::Line(point + dir * offset, dir),
+                                frame.factor * material.getTransmit() * scale * deviation.second / total_weight,
+                                frame.weight * material.getTransmit() * scale,
+                                frame.jumps - 1,
+                                frame.depth + 1,
+                                frame.travelled + current.distance,
+                                Mix(Mix(frame.key, TRANSMIT), i)
+                            });
+                        }
                     }
                 }
             }
 
-            ambient *= material.getAmbient() * pigment;
-
             if (material.getSpecular() > Geometry::EPSILON || material.getDiffuse() > Geometry::EPSILON) {
-                for (const auto &light : lights) {
 
-                    static Geometry::Vec<3> normal_ignore;
-                    static Pigment::Color pigment_ignore;
-                    static Light::Material material_ignore;
-                    bool inside_ignore;
+                // Most the point can send towards the pixel for a light of unit intensity
+                const float_max_t reach = frame.factor * (
+                    material.getDiffuse() * std::max(std::max(pigment[0], pigment[1]), pigment[2]) + material.getSpecular()
+                );
+
+                lights.visit(point, reach, Mix(frame.key, LIGHTS), [ & ] (unsigned light_index, float_max_t light_weight) {
+
+                    const Light::Light *light = lights[light_index];
 
                     Pigment::Color light_accumulated(0.0, 0.0, 0.0);
 
                     const Geometry::Vec<3> delta = light->getPosition() - point;
-                    const float_max_t light_distance = delta.length();
+                    const float_max_t
+                        light_distance = delta.length(),
+                        attenuation = 1.0 / (
+                            light->getConstantAttenuation() +
+                            light_distance * light->getLinearAttenuation() +
+                            light_distance * light_distance * light->getQuadraticAttenuation()
+                        );
                     const Geometry::Vec<3>
                         direction = delta / light_distance,
                         up_dir = direction.perpendicular().normalized(),
                         right_dir = direction.cross(up_dir).normalized();
 
-                    for (const auto &deviation : light_deviations) {
-                        const Geometry::Vec<3> dir = ((light->getPosition() + deviation[0] * right_dir + deviation[1] * up_dir) - point).normalized();
+                    auto towards = [ & ] (unsigned i) {
+                        const Geometry::Vec<2> &deviation = light_deviations[i];
+                        return ((light->getPosition() + deviation[0] * right_dir + deviation[1] * up_dir) - point).normalized();
+                    };
 
-                        float_max_t obstacle_distance = light_distance;
+                    auto lit = [ & ] (unsigned i, const Geometry::Vec<3> &dir) {
 
-                        bool collides = Collision(
-                            Geometry::Line(point + dir * Geometry::EPSILON, dir),
-                            shapes,
-                            obstacle_distance,
-                            false,
-                            normal_ignore,
-                            inside_ignore,
-                            pigment_ignore,
-                            material_ignore
-                        );
+                        const Geometry::Line shadow(point + dir * offset, dir);
+                        const Shape::Shape *&occluder = shadows.occluders[
+                            (std::min(frame.depth, ShadowCache::DEPTHS - 1) * lights.size() + light_index) * light_deviations.size() + i
+                        ];
+
+                        ++shadows.queries;
+
+                        bool blocked;
+
+                        if (occluder != nullptr && Blocks(occluder, shadow, light_distance)) {
+                            ++shadows.hits;
+                            blocked = true;
+                        } else {
+                            blocked = Occluded(shadow, shapes, light_distance, &occluder);
+                        }
+
+                        shadows.blocked += blocked;
+
+                        return !blocked;
+                    };
 
-                        if (!collides) {
-                            const Geometry::Vec<3> h = ((dir - line.getDirection()) / 2).normalized();
-                            const float_max_t
-                                attenuation = 1.0 / (
-                                    light->getConstantAttenuation() +
-                                    light_distance * light->getLinearAttenuation() +
-                                    light_distance * light_distance * light->getQuadraticAttenuation()
-                                ),
-                                diffuse = std::max(normal.dot(dir), 0.0) * material.getDiffuse(),
-                                specular = std::pow(normal.dot(h), material.getAlpha()) * material.getSpecular();
-
-                            light_accumulated += ((diffuse * pigment) + specular) * light->getColor() * attenuation;
+                    auto illuminate = [ & ] (const Geometry::Vec<3> &dir) {
+                        const Geometry::Vec<3> h = ((dir - ray.getDirection()) / 2).normalized();
+                        const float_max_t
+                            diffuse = std::max(normal.dot(dir), 0.0) * material.getDiffuse(),
+                            specular = std::pow(normal.dot(h), material.getAlpha()) * material.getSpecular();
+
+                        light_accumulated += ((diffuse * pigment) + specular) * light->getColor() * attenuation;
+                    };
+
+                    // The probes decide the whole light when they agree, which only penumbrae fail to do
+                    const bool probing = probe_count > 0 && light_count > probe_count;
+
+                    bool probed[MAX_PROBES], sampled = false;
+                    unsigned lit_probes = 0;
+
+                    if (probing) {
+
+                        for (unsigned k = 0; k < probe_count; ++k) {
+                            probed[k] = lit(probes[k], towards(probes[k]));
+                            lit_probes += probed[k];
+                        }
+
+                        if (lit_probes == 0) {
+                            sampled = true;
+                        } else if (lit_probes == probe_count) {
+                            for (unsigned i = 0; i < light_count; ++i) {
+                                illuminate(towards(i));
+                            }
+                            sampled = true;
                         }
                     }
 
-                    accumulated += light_accumulated / light_deviations.size();
-                }
-            }
+                    if (!sampled) {
+                        for (unsigned i = 0; i < light_count; ++i) {
+
+                            const Geometry::Vec<3> dir = towards(i);
 
-            color = reflected + ambient + accumulated + transmitted;
+                            const unsigned *probe = probing ? std::find(probes, probes + probe_count, i) : probes + probe_count;
+
+                            if (probe != probes + probe_count ? probed[probe - probes] : lit(i, dir)) {
+                                illuminate(dir);
+                            }
+                        }
+                    }
+
+                    accumulated += light_accumulated * light_weight / light_count;
+                });
+            }
 
+            result += (ambient * material.getAmbient() * pigment + accumulated) * frame.factor;
         }
 
-        return color;
+        return result;
     }
 }
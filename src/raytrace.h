@@ -1,29 +1,237 @@
+#include <cstdint>
+#include <limits>
 #include <vector>
 #include "graphics/graphics.h"
+#include "bvh.h"
+#include "primitives.h"
+#include "mesh.h"
+#include "lights.h"
+#include "random.h"
+#include "textures.h"
 
 namespace RayTrace {
 
+    class ShapeSet {
+
+    public:
+
+        struct Entry {
+            const Shape::Shape *shape;
+            // Position of the shape in the scene file, which decides ties between equally distant hits
+            unsigned order;
+            ShapeInfo info;
+        };
+
+    private:
+
+        std::vector<Entry> unbounded, bounded;
+        BVH bvh;
+
+        // Plain spheres and boxes, kept apart so they skip the virtual intersection call
+        PrimitiveStore spheres, boxes;
+
+        // What the loader knew about every shape, in scene order
+        std::vector<ShapeInfo> infos;
+
+        // Different for every set built, so that caches kept across traces can tell shapes of an earlier scene apart
+        std::uint64_t generation;
+
+    public:
+
+        // Hierarchies from getHierarchies of the same scene are used as they are instead of being built again
+        ShapeSet (
+            const std::vector<Shape::Shape *> &shapes,
+            const std::vector<ShapeInfo> &infos,
+            const std::vector<BVH> &hierarchies = {}
+        );
+
+        // Hierarchies over the bounded shapes, the spheres and the boxes
+        inline std::vector<BVH> getHierarchies () const { return { this->bvh, this->spheres.bvh, this->boxes.bvh }; }
+
+        inline const ShapeInfo &getInfo (unsigned order) const { return this->infos[order]; }
+        inline std::uint64_t getGeneration () const { return this->generation; }
+
+        // Shapes that must go through Shape::intersectLine
+        template <typename Visitor>
+        bool traverse (const BVH::Ray &ray, const float_max_t &distance, Visitor visit) const {
+            for (const Entry &entry : this->unbounded) {
+                if (visit(entry.shape, entry.order)) {
+                    return true;
+                }
+            }
+            return this->bvh.traverse(ray, distance, [ this, &visit ] (unsigned index) {
+                return visit(this->bounded[index].shape, this->bounded[index].order);
+            });
+        }
+
+        template <typename Visitor>
+        void traverse (const BVH::Packet &packet, const float_max_t distance[BVH::PACKET_SIZE], Visitor visit) const {
+            for (const Entry &entry : this->unbounded) {
+                visit(entry);
+            }
+            this->bvh.traverseLeaves(packet, distance, [ this, &visit ] (unsigned offset, unsigned count) {
+                for (unsigned i = offset, end = offset + count; i < end; ++i) {
+                    visit(this->bounded[i]);
+                }
+            });
+        }
+
+        // Leaves of the sphere and box stores, as blocks of at most PrimitiveStore::BLOCK_SIZE shapes
+        template <typename Visitor>
+        bool traverseBlocks (const BVH::Ray &ray, const float_max_t &distance, Visitor visit) const {
+            for (const PrimitiveStore *store : { &this->spheres, &this->boxes }) {
+                const bool stop = store->bvh.traverseLeaves(ray, distance, [ store, &visit ] (unsigned offset, unsigned count) {
+                    for (unsigned end = offset + count; offset < end; offset += PrimitiveStore::BLOCK_SIZE) {
+                        if (visit(*store, offset, std::min(end - offset, PrimitiveStore::BLOCK_SIZE))) {
+                            return true;
+                        }
+                    }
+                    return false;
+                });
+                if (stop) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        template <typename Visitor>
+        void traverseBlocks (const BVH::Packet &packet, const float_max_t distance[BVH::PACKET_SIZE], Visitor visit) const {
+            for (const PrimitiveStore *store : { &this->spheres, &this->boxes }) {
+                store->bvh.traverseLeaves(packet, distance, [ store, &visit ] (unsigned offset, unsigned count) {
+                    for (unsigned end = offset + count; offset < end; offset += PrimitiveStore::BLOCK_SIZE) {
+                        visit(*store, offset, std::min(end - offset, PrimitiveStore::BLOCK_SIZE));
+                    }
+                });
+            }
+        }
+    };
+
+    // Limits on how much of the ray tree below a camera ray gets traced
+    struct Pruning {
+        // Branches whose share of the pixel color falls below this are cut, or kept with probability share / threshold
+        // and scaled up to match when Russian roulette is enabled, which keeps the estimate unbiased
+        float_max_t threshold = 0.0;
+        bool roulette = false;
+        // Bounces past this depth cast only the central ray of each light, reflection and transmission distribution
+        unsigned distribute_depth = std::numeric_limits<unsigned>::max();
+    };
+
+    // How the shadow rays towards area lights are cast
+    struct ShadowSampling {
+        // Area lights are first probed at their center and corners, and only fully sampled when those disagree
+        bool adaptive = false;
+    };
+
+    // Closest intersection found by Intersect, enough to evaluate the shading attributes later on
+    struct Hit {
+        const Shape::Shape *shape = nullptr;
+        // Position of the shape in the scene file
+        unsigned order = 0;
+        float_max_t distance = std::numeric_limits<float_max_t>::infinity();
+        // Whether the ray entered the shape (its nearest intersection) or is leaving it
+        bool front = true;
+        // Part of a box, cylinder, polyhedron or mesh the hit lies on: 2 * axis plus one for the upper side of a box,
+        // the side, bottom or top of a cylinder, the index of a polyhedron face and the triangle of a mesh
+        unsigned face = 0;
+        // Barycentric coordinates of a mesh hit, as in Mesh::Hit
+        float_max_t u = 0.0, v = 0.0;
+    };
+
+    bool Intersect (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        Hit &hit
+    );
+
+    // Closest hits for up to BVH::PACKET_SIZE coherent rays at once
+    void Intersect (
+        const Geometry::Line *lines,
+        unsigned count,
+        const ShapeSet &shapes,
+        Hit *hits
+    );
+
+    // Normal, side, pigment and material at a hit. Spheres, boxes, cylinders and polyhedra whose surface and pigment
+    // were baked are answered from the hit and their ShapeInfo alone, every other shape through Shape::intersectLine.
+    void Shade (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        const Hit &hit,
+        Geometry::Vec<3> &normal,
+        bool &inside,
+        Pigment::Color &pigment,
+        Material &material
+    );
+
     bool Collision (
         const Geometry::Line &line,
-        const std::vector<Shape::Shape *> &shapes,
+        const ShapeSet &shapes,
         float_max_t &distance,
         bool get_info,
         Geometry::Vec<3> &normal,
         bool &inside,
         Pigment::Color &pigment,
-        Light::Material &material
+        Material &material
+    );
+
+    // Any-hit query, which stores the blocking shape in occluder when one is given
+    bool Occluded (
+        const Geometry::Line &line,
+        const ShapeSet &shapes,
+        float_max_t distance,
+        const Shape::Shape **occluder = nullptr
     );
 
+    // Shadow rays traced by every thread so far, how many were blocked, and how many of those the occluder caches answered
+    struct ShadowCacheStats {
+        unsigned long long queries, blocked, hits;
+    };
+
+    // Adds what the calling thread counted since its last call to the totals. Threads count on their own, and
+    // only what they flushed shows in GetShadowCacheStats.
+    void FlushShadowCacheStats ();
+
+    ShadowCacheStats GetShadowCacheStats ();
+
     Pigment::Color Trace (
         const Geometry::Line &line,
-        const std::vector<Shape::Shape *> &shapes,
+        const ShapeSet &shapes,
         Pigment::Color ambient,
-        const std::vector<Light::Light *> &lights,
+        const LightSet &lights,
         const std::vector<Geometry::Vec<2>> &light_deviations = { { 0.0, 0.0 } },
         const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &reflect_deviations = { { 0.0, 0.0 } },
         const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &transmit_deviations = { { 0.0, 0.0 } },
         Pigment::Color color = Pigment::Color::rgb(127, 127, 127),
-        unsigned jumps = 10
+        unsigned jumps = 10,
+        const Pruning &pruning = Pruning(),
+        const ShadowSampling &sampling = ShadowSampling(),
+        float_max_t weight = 1.0,
+        unsigned depth = 0,
+        float_max_t spread = 0.0,
+        std::uint64_t seed = 0
+    );
+
+    // Continues tracing from a hit that was already found for the line. Spread is the angle between neighbouring
+    // camera rays, from which the footprint of every hit on textures is estimated. Seed picks the branches Russian
+    // roulette keeps, and is best made from the pixel and sample with Mix.
+    Pigment::Color Trace (
+        const Geometry::Line &line,
+        const Hit &hit,
+        const ShapeSet &shapes,
+        Pigment::Color ambient,
+        const LightSet &lights,
+        const std::vector<Geometry::Vec<2>> &light_deviations,
+        const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &reflect_deviations,
+        const std::vector<std::pair<Geometry::Vec<2>, float_max_t>> &transmit_deviations,
+        Pigment::Color color,
+        unsigned jumps,
+        const Pruning &pruning = Pruning(),
+        const ShadowSampling &sampling = ShadowSampling(),
+        float_max_t weight = 1.0,
+        unsigned depth = 0,
+        float_max_t spread = 0.0,
+        std::uint64_t seed = 0
     );
 
 };
@@ -0,0 +1,31 @@
+#ifndef SRC_SCENE_H_
+#define SRC_SCENE_H_
+
+#include <vector>
+#include "graphics/graphics.h"
+#include "arena.h"
+#include "bvh.h"
+#include "primitives.h"
+
+namespace RayTrace {
+
+    // Everything read from a scene file. The objects all belong to its arena and go away with it.
+    struct Scene {
+
+        Arena arena;
+
+        Geometry::Camera camera;
+        Pigment::Color ambient;
+        std::vector<Light::Light *> lights;
+        std::vector<Pigment::Texture *> pigments;
+        std::vector<Light::Surface *> surfaces;
+        std::vector<Shape::Shape *> shapes;
+        std::vector<ShapeInfo> infos;
+
+        // Shape hierarchies stored in a compiled scene, empty for text scenes
+        std::vector<BVH> hierarchies;
+    };
+
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "scenestream.h"
+
+namespace FileManip {
+
+    namespace {
+
+        // Powers of ten that doubles hold exactly
+        const double EXACT_POWERS[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        inline bool isSpace (char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+        inline bool isDigit (char c) { return c >= '0' && c <= '9'; }
+
+        inline void convert (const char *text, float &value) { value = std::strtof(text, nullptr); }
+        inline void convert (const char *text, double &value) { value = std::strtod(text, nullptr); }
+        inline void convert (const char *text, long double &value) { value = std::strtold(text, nullptr); }
+    }
+
+    bool parseNumber (const char *begin, const char *end, float_max_t &value) {
+
+        const char *c = begin;
+        const bool negative = c < end && *c == '-';
+        std::uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool any = false, exact = true;
+
+        if (c < end && (*c == '-' || *c == '+')) {
+            ++c;
+        }
+
+        // At most 19 significant digits fit the mantissa, any further ones only matter to the slow path
+        for (; c < end && isDigit(*c); ++c, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*c - '0');
+                digits += mantissa > 0;
+            } else {
+                ++exponent;
+                exact = exact && *c == '0';
+            }
+        }
+
+        if (c < end && *c == '.') {
+            for (++c; c < end && isDigit(*c); ++c, any = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*c - '0');
+                    digits += mantissa > 0;
+                    --exponent;
+                } else {
+                    exact = exact && *c == '0';
+                }
+            }
+        }
+
+        if (!any) {
+            return false;
+        }
+
+        if (c < end && (*c == 'e' || *c == 'E')) {
+            const bool negative_exponent = c + 1 < end && c[1] == '-';
+            int written = 0;
+            c += c + 1 < end && (c[1] == '-' || c[1] == '+') ? 2 : 1;
+            if (c == end || !isDigit(*c)) {
+                return false;
+            }
+            for (; c < end && isDigit(*c); ++c) {
+                written = std::min(written * 10 + (*c - '0'), 100000);
+            }
+            exponent += negative_exponent ? -written : written;
+        }
+
+        if (c != end) {
+            return false;
+        }
+
+        // Both the mantissa and the power of ten are exact doubles, so a single operation rounds correctly
+        if (sizeof(float_max_t) == sizeof(double) && exact && mantissa <= (std::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+            const double magnitude = exponent < 0 ? mantissa / EXACT_POWERS[-exponent] : mantissa * EXACT_POWERS[exponent];
+            value = negative ? -magnitude : magnitude;
+            return true;
+        }
+
+        char buffer[64];
+        if (end - begin < static_cast<std::ptrdiff_t>(sizeof(buffer))) {
+            std::copy(begin, end, buffer);
+            buffer[end - begin] = '\0';
+            convert(buffer, value);
+        } else {
+            convert(std::string(begin, end).c_str(), value);
+        }
+
+        return true;
+    }
+
+    bool SceneStream::next (const char *what) {
+
+        if (!this->good()) {
+            return false;
+        }
+
+        const char *c = this->data;
+
+        for (; c < this->end && isSpace(*c); ++c) {
+            if (*c == '\n') {
+                ++this->line;
+                this->line_start = c + 1;
+            }
+        }
+
+        this->token = c;
+
+        if (c == this->end) {
+            this->error(std::string("expected ") + what + ", found the end of the scene");
+            this->data = c;
+            return false;
+        }
+
+        for (; c < this->end && !isSpace(*c); ++c);
+
+        this->data = c;
+
+        return true;
+    }
+
+    void SceneStream::error (const std::string &message) {
+
+        if (!this->good()) {
+            return;
+        }
+
+        if (this->mode == COMPILED) {
+            this->failure = "byte " + std::to_string(this->data - this->begin) + ": " + message;
+        } else {
+            this->failure = "line " + std::to_string(this->line) + ", column " + std::to_string(this->token - this->line_start + 1) + ": " + message;
+        }
+    }
+
+    SceneStream &SceneStream::operator>> (float_max_t &value) {
+        if (this->mode == COMPILED) {
+            double stored = 0.0;
+            if (this->good()) {
+                this->load(stored);
+            }
+            value = stored;
+            return *this;
+        }
+        value = 0.0;
+        if (this->next("a number")) {
+            if (!parseNumber(this->token, this->data, value)) {
+                this->error("expected a number, found '" + std::string(this->token, this->data) + "'");
+                value = 0.0;
+            } else if (this->mode == RECORD) {
+                this->store(static_cast<double>(value));
+            }
+        }
+        return *this;
+    }
+
+    SceneStream &SceneStream::operator>> (unsigned &value) {
+        if (this->mode == COMPILED) {
+            std::uint32_t stored = 0;
+            if (this->good()) {
+                this->load(stored);
+            }
+            value = stored;
+            return *this;
+        }
+        value = 0;
+        if (this->next("a count or index")) {
+            std::uint64_t parsed = 0;
+            const char *c = this->token;
+            for (; c < this->data && isDigit(*c) && parsed <= std::numeric_limits<unsigned>::max(); ++c) {
+                parsed = parsed * 10 + (*c - '0');
+            }
+            if (c != this->data || c == this->token || parsed > std::numeric_limits<unsigned>::max()) {
+                this->error("expected a count or index, found '" + std::string(this->token, this->data) + "'");
+            } else {
+                value = parsed;
+                if (this->mode == RECORD) {
+                    this->store(static_cast<std::uint32_t>(value));
+                }
+            }
+        }
+        return *this;
+    }
+
+    SceneStream &SceneStream::operator>> (std::string &value) {
+        if (this->mode == COMPILED) {
+            std::uint32_t length = 0;
+            value.clear();
+            if (this->good()) {
+                this->load(length);
+            }
+            if (static_cast<std::size_t>(this->end - this->data) < length) {
+                this->error("the compiled scene ends too early");
+            } else if (this->good()) {
+                value.assign(this->data, length);
+                this->data += length;
+            }
+            return *this;
+        }
+        value.clear();
+        if (this->next("a word")) {
+            value.assign(this->token, this->data);
+            if (this->mode == RECORD) {
+                this->store(static_cast<std::uint32_t>(value.size()));
+                this->recording.insert(this->recording.end(), value.begin(), value.end());
+            }
+        }
+        return *this;
+    }
+
+    SceneStream &SceneStream::count (unsigned &value) {
+        *this >> value;
+        if (value > static_cast<std::size_t>(this->end - this->data)) {
+            this->error("a count of " + std::to_string(value) + " does not fit in the rest of the scene");
+            value = 0;
+        }
+        return *this;
+    }
+
+    SceneStream &SceneStream::operator>> (Geometry::Quaternion &value) {
+
+        Geometry::Vec<4> components;
+        std::ostringstream text;
+
+        *this >> components;
+
+        text.precision(std::numeric_limits<double>::max_digits10);
+        text << components[0] << ' ' << components[1] << ' ' << components[2] << ' ' << components[3];
+
+        std::istringstream numbers(text.str());
+        numbers >> value;
+
+        return *this;
+    }
+
+    MappedFile::MappedFile (const std::string &path) {
+#ifdef __linux__
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor >= 0) {
+            struct stat status;
+            if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+                void *address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                if (address != MAP_FAILED) {
+                    this->data = static_cast<const char *>(address);
+                    this->size = status.st_size;
+                    this->mapped = true;
+                }
+            }
+            close(descriptor);
+            if (this->mapped) {
+                return;
+            }
+        }
+#endif
+        std::ifstream input(path, std::ios::binary);
+        if (input.is_open()) {
+            this->buffer.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            this->data = this->buffer.data();
+            this->size = this->buffer.size();
+        }
+    }
+
+    MappedFile::~MappedFile () {
+#ifdef __linux__
+        if (this->mapped) {
+            munmap(const_cast<char *>(this->data), this->size);
+        }
+#endif
+    }
+
+};
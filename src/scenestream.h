@@ -0,0 +1,142 @@
+#ifndef SRC_SCENESTREAM_H_
+#define SRC_SCENESTREAM_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "graphics/graphics.h"
+
+namespace FileManip {
+
+    // Where the scene readers take their values from: a text scene, a text scene whose values are also kept in the
+    // compiled form, or a compiled scene, all of them already in memory. Compiled scenes are the values in the order
+    // the readers consume them, numbers as doubles, counts as 32 bit integers, words as their length followed by
+    // their characters and arrays as their length followed by their values. Text is split at white space and parsed
+    // in place, one token at a time.
+    //
+    // Reading stops at the first error, after which numbers read as zero and words as empty.
+    class SceneStream {
+
+    public:
+
+        enum Mode { TEXT, RECORD, COMPILED };
+
+    private:
+
+        Mode mode;
+        const char *begin, *data, *end;
+        std::vector<char> recording;
+        std::string failure;
+
+        // Last token read and the line it is on, for error positions
+        const char *token, *line_start;
+        unsigned line = 1;
+
+        // Next text token as [token, data), false at the end of the input
+        bool next (const char *what);
+
+        template <typename T>
+        inline void load (T &value) {
+            if (this->end - this->data < static_cast<std::ptrdiff_t>(sizeof(T))) {
+                this->error("the compiled scene ends too early");
+                value = T();
+                return;
+            }
+            std::memcpy(&value, this->data, sizeof(T));
+            this->data += sizeof(T);
+        }
+
+        template <typename T>
+        inline void store (const T &value) {
+            const char *bytes = reinterpret_cast<const char *>(&value);
+            this->recording.insert(this->recording.end(), bytes, bytes + sizeof(T));
+        }
+
+    public:
+
+        SceneStream (const char *data, std::size_t size, Mode mode = TEXT) :
+            mode(mode), begin(data), data(data), end(data + size), token(data), line_start(data) {}
+
+        inline Mode getMode () const { return this->mode; }
+        inline bool good () const { return this->failure.empty(); }
+        inline const std::vector<char> &getRecording () const { return this->recording; }
+
+        // First error, with the line and column of the token it was found at for text scenes
+        inline const std::string &getError () const { return this->failure; }
+        void error (const std::string &message);
+
+        SceneStream &operator>> (float_max_t &value);
+        SceneStream &operator>> (unsigned &value);
+        SceneStream &operator>> (std::string &value);
+
+        // Amount of items to follow, which fails when not even that many bytes are left
+        SceneStream &count (unsigned &value);
+
+        // Four numbers handed to the library reader, whatever it makes of them
+        SceneStream &operator>> (Geometry::Quaternion &value);
+
+        // Values the readers make from other files when reading text, like the vertices of a mesh, which compiled
+        // scenes hold as a 64 bit length followed by the values as Stored. Text scenes leave them as they are.
+        template <typename Stored, typename T>
+        SceneStream &array (std::vector<T> &values) {
+            if (this->mode == RECORD) {
+                this->store(static_cast<std::uint64_t>(values.size()));
+                for (const T &value : values) {
+                    this->store(static_cast<Stored>(value));
+                }
+            } else if (this->mode == COMPILED) {
+                std::uint64_t size = 0;
+                values.clear();
+                if (this->good()) {
+                    this->load(size);
+                }
+                if (static_cast<std::uint64_t>(this->end - this->data) / sizeof(Stored) < size) {
+                    this->error("the compiled scene ends too early");
+                } else if (this->good()) {
+                    values.resize(size);
+                    for (T &value : values) {
+                        Stored stored;
+                        this->load(stored);
+                        value = static_cast<T>(stored);
+                    }
+                }
+            }
+            return *this;
+        }
+
+        template <unsigned N>
+        inline SceneStream &operator>> (Geometry::Vec<N> &value) {
+            for (unsigned i = 0; i < N; ++i) {
+                *this >> value[i];
+            }
+            return *this;
+        }
+    };
+
+    // Parses the whole of [begin, end) as a decimal number, rounded the same way as strtod
+    bool parseNumber (const char *begin, const char *end, float_max_t &value);
+
+    // Read-only view of a whole file, mapped into memory where the system allows it and read into it otherwise
+    class MappedFile {
+
+        const char *data = nullptr;
+        std::size_t size = 0;
+        bool mapped = false;
+        std::vector<char> buffer;
+
+    public:
+
+        MappedFile (const std::string &path);
+        MappedFile (const MappedFile &) = delete;
+        MappedFile &operator= (const MappedFile &) = delete;
+        ~MappedFile ();
+
+        inline bool isOpen () const { return this->data != nullptr; }
+        inline const char *getData () const { return this->data; }
+        inline std::size_t getSize () const { return this->size; }
+    };
+
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "scheduler.h"
+
+namespace RayTrace {
+
+    namespace {
+
+        inline uint64_t spread (uint64_t value) {
+            value &= 0xFFFFFFFF;
+            value = (value | (value << 16)) & 0x0000FFFF0000FFFF;
+            value = (value | (value << 8)) & 0x00FF00FF00FF00FF;
+            value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0F;
+            value = (value | (value << 2)) & 0x3333333333333333;
+            value = (value | (value << 1)) & 0x5555555555555555;
+            return value;
+        }
+
+        inline uint64_t morton (unsigned x, unsigned y) {
+            return spread(x) | (spread(y) << 1);
+        }
+    }
+
+    TileScheduler::TileScheduler (unsigned image_width, unsigned image_height, unsigned tile_size, unsigned threads) :
+        queues(new Queue[std::max(threads, 1u)]), threads(std::max(threads, 1u)) {
+
+        tile_size = std::max(tile_size, 1u);
+
+        const unsigned
+            columns = (image_width + tile_size - 1) / tile_size,
+            rows = (image_height + tile_size - 1) / tile_size;
+
+        std::vector<std::pair<uint64_t, Tile>> ordered;
+
+        for (unsigned row = 0; row < rows; ++row) {
+            for (unsigned column = 0; column < columns; ++column) {
+                const unsigned x = column * tile_size, y = row * tile_size;
+                ordered.push_back({ morton(column, row), { x, y, std::min(tile_size, image_width - x), std::min(tile_size, image_height - y) } });
+            }
+        }
+
+        std::sort(ordered.begin(), ordered.end(), [] (const std::pair<uint64_t, Tile> &first, const std::pair<uint64_t, Tile> &second) {
+            return first.first < second.first;
+        });
+
+        for (const auto &entry : ordered) {
+            this->tiles.push_back(entry.second);
+        }
+
+        this->reset();
+    }
+
+    void TileScheduler::reset () {
+
+        const uint64_t count = this->tiles.size();
+
+        for (unsigned thread = 0; thread < this->threads; ++thread) {
+            this->queues[thread].range.store(pack(count * thread / this->threads, count * (thread + 1) / this->threads));
+        }
+    }
+
+    bool TileScheduler::next (unsigned thread, Tile &tile) {
+
+        Queue &own = this->queues[thread % this->threads];
+
+        uint64_t range = own.range.load(std::memory_order_acquire);
+
+        while (begin(range) < end(range)) {
+            if (own.range.compare_exchange_weak(range, pack(begin(range) + 1, end(range)), std::memory_order_acq_rel)) {
+                tile = this->tiles[begin(range)];
+                return true;
+            }
+        }
+
+        for (unsigned offset = 1; offset < this->threads; ++offset) {
+
+            Queue &victim = this->queues[(thread + offset) % this->threads];
+
+            range = victim.range.load(std::memory_order_acquire);
+
+            while (begin(range) < end(range)) {
+                const unsigned
+                    first = begin(range),
+                    last = end(range),
+                    middle = last - (last - first + 1) / 2;
+                if (victim.range.compare_exchange_weak(range, pack(first, middle), std::memory_order_acq_rel)) {
+                    // The owner queue is empty, so only thieves can be looking at it and they leave empty queues alone
+                    own.range.store(pack(middle + 1, last), std::memory_order_release);
+                    tile = this->tiles[middle];
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    bool PinThread (unsigned core) {
+#ifdef __linux__
+        const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core % cores, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+};
@@ -0,0 +1,52 @@
+#ifndef SRC_SCHEDULER_H_
+#define SRC_SCHEDULER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace RayTrace {
+
+    struct Tile {
+        unsigned x, y, width, height;
+    };
+
+    // Splits the image in square tiles walked along a Morton curve, and hands every thread a contiguous
+    // run of them. A thread that runs out of tiles steals half of what is left in another thread's queue.
+    class TileScheduler {
+
+        // Pending tiles [begin, end) of one thread, packed in a single word so that pops and steals are one CAS.
+        // Padded to its own cache line so neighbouring queues are not invalidated by each other's updates.
+        struct Queue {
+            std::atomic<uint64_t> range;
+            char padding[64 - sizeof(std::atomic<uint64_t>)];
+        };
+
+        std::vector<Tile> tiles;
+        std::unique_ptr<Queue[]> queues;
+        unsigned threads;
+
+        static inline uint64_t pack (uint64_t begin, uint64_t end) { return begin | (end << 32); }
+        static inline unsigned begin (uint64_t range) { return range & 0xFFFFFFFF; }
+        static inline unsigned end (uint64_t range) { return range >> 32; }
+
+    public:
+
+        TileScheduler (unsigned image_width, unsigned image_height, unsigned tile_size, unsigned threads);
+
+        // Next tile for the thread, false once every tile of the image has been handed out
+        bool next (unsigned thread, Tile &tile);
+
+        // Hands every tile out again, split between the threads as at construction. Only call it while no thread is in next.
+        void reset ();
+
+        inline unsigned size () const { return this->tiles.size(); }
+    };
+
+    // Binds the calling thread to one core, where the platform allows it
+    bool PinThread (unsigned core);
+
+};
+
+#endif
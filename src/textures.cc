@@ -0,0 +1,268 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "textures.h"
+
+namespace RayTrace {
+
+    namespace {
+
+        inline float_max_t fract (float_max_t value) {
+            return value - std::floor(value);
+        }
+
+        inline float_max_t channel (std::uint32_t texel, unsigned index) {
+            return static_cast<float_max_t>((texel >> (8 * index)) & 0xFFu) / 255.0;
+        }
+    }
+
+    constexpr unsigned MipMap::TILE_SIZE;
+
+    float_max_t &Footprint () {
+        static thread_local float_max_t footprint = 0.0;
+        return footprint;
+    }
+
+    MipMap::Level MipMap::allocate (unsigned width, unsigned height) {
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        level.texels.resize(level.tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE) * TILE_SIZE * TILE_SIZE, 0);
+        return level;
+    }
+
+    void MipMap::store (Level &level, unsigned x, unsigned y, const float_max_t rgb[3]) {
+        std::uint32_t texel = 0;
+        for (unsigned i = 0; i < 3; ++i) {
+            texel |= static_cast<std::uint32_t>(std::round(std::min(std::max(rgb[i], 0.0), 1.0) * 255.0)) << (8 * i);
+        }
+        const unsigned tile = (y / TILE_SIZE) * level.tiles_x + x / TILE_SIZE;
+        level.texels[tile * TILE_SIZE * TILE_SIZE + morton(x % TILE_SIZE, y % TILE_SIZE)] = texel;
+    }
+
+    MipMap::MipMap (const cv::Mat &image) {
+
+        if (image.empty()) {
+            return;
+        }
+
+        this->levels.push_back(allocate(image.cols, image.rows));
+
+        for (int y = 0; y < image.rows; ++y) {
+            for (int x = 0; x < image.cols; ++x) {
+                const cv::Vec3b &bgr = image.at<cv::Vec3b>(y, x);
+                const float_max_t rgb[3] = { bgr[2] / 255.0, bgr[1] / 255.0, bgr[0] / 255.0 };
+                store(this->levels[0], x, y, rgb);
+            }
+        }
+
+        // Every level averages blocks of two by two texels of the one above, the last row or column of odd sizes
+        // being counted twice
+        while (this->levels.back().width > 1 || this->levels.back().height > 1) {
+
+            const Level &above = this->levels.back();
+            Level level = allocate(std::max(1u, (above.width + 1) / 2), std::max(1u, (above.height + 1) / 2));
+
+            for (unsigned y = 0; y < level.height; ++y) {
+                for (unsigned x = 0; x < level.width; ++x) {
+                    const unsigned
+                        x_0 = std::min(2 * x, above.width - 1), x_1 = std::min(2 * x + 1, above.width - 1),
+                        y_0 = std::min(2 * y, above.height - 1), y_1 = std::min(2 * y + 1, above.height - 1);
+                    float_max_t rgb[3];
+                    for (unsigned i = 0; i < 3; ++i) {
+                        rgb[i] = (
+                            channel(above.at(x_0, y_0), i) + channel(above.at(x_1, y_0), i) +
+                            channel(above.at(x_0, y_1), i) + channel(above.at(x_1, y_1), i)
+                        ) * 0.25;
+                    }
+                    store(level, x, y, rgb);
+                }
+            }
+
+            this->levels.push_back(std::move(level));
+        }
+    }
+
+    std::size_t MipMap::memory () const {
+        std::size_t bytes = 0;
+        for (const Level &level : this->levels) {
+            bytes += level.texels.size() * sizeof(std::uint32_t);
+        }
+        return bytes;
+    }
+
+    Pigment::Color MipMap::bilinear (const Level &level, float_max_t x, float_max_t y) const {
+
+        const unsigned
+            x_0 = std::min(static_cast<unsigned>(x), level.width - 1),
+            y_0 = std::min(static_cast<unsigned>(y), level.height - 1),
+            x_1 = std::min(x_0 + 1, level.width - 1),
+            y_1 = std::min(y_0 + 1, level.height - 1);
+        const float_max_t
+            fx = x - x_0,
+            fy = y - y_0;
+        const std::uint32_t
+            t_00 = level.at(x_0, y_0), t_10 = level.at(x_1, y_0),
+            t_01 = level.at(x_0, y_1), t_11 = level.at(x_1, y_1);
+
+        float_max_t rgb[3];
+
+        for (unsigned i = 0; i < 3; ++i) {
+            const float_max_t
+                top = channel(t_00, i) + (channel(t_10, i) - channel(t_00, i)) * fx,
+                bottom = channel(t_01, i) + (channel(t_11, i) - channel(t_01, i)) * fx;
+            rgb[i] = top + (bottom - top) * fy;
+        }
+
+        return Pigment::Color(rgb[0], rgb[1], rgb[2]);
+    }
+
+    Pigment::Color MipMap::sample (float_max_t u, float_max_t v, float_max_t lod) const {
+
+        if (this->levels.empty()) {
+            return Pigment::Color(0.0, 0.0, 0.0);
+        }
+
+        auto at = [ & ] (unsigned index) {
+            const Level &level = this->levels[index];
+            return this->bilinear(level, u * (level.width - 1), (1.0 - v) * (level.height - 1));
+        };
+
+        const unsigned last = this->levels.size() - 1;
+
+        if (!(lod > 0.0)) {
+            return at(0);
+        }
+        if (lod >= last) {
+            return at(last);
+        }
+
+        const unsigned index = static_cast<unsigned>(lod);
+        const float_max_t blend = lod - index;
+
+        return at(index) * (1.0 - blend) + at(index + 1) * blend;
+    }
+
+    void TextureCache::Entry::decode () {
+        this->mipmap = MipMap(cv::imread(this->path));
+        this->decoded.store(true, std::memory_order_release);
+    }
+
+    TextureCache &TextureCache::instance () {
+        static TextureCache cache;
+        return cache;
+    }
+
+    TextureCache::Entry *TextureCache::request (const std::string &path) {
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        std::unique_ptr<Entry> &entry = this->entries[path];
+
+        if (!entry) {
+            entry.reset(new Entry(path));
+        }
+        ++this->references[path];
+
+        return entry.get();
+    }
+
+    void TextureCache::release (Entry *entry) {
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        const std::string path = entry->getPath();
+        auto references = this->references.find(path);
+
+        if (references != this->references.end() && --references->second == 0) {
+            this->references.erase(references);
+            this->entries.erase(path);
+        }
+    }
+
+    void TextureCache::load () {
+
+        std::vector<Entry *> pending;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (auto &entry : this->entries) {
+                pending.push_back(entry.second.get());
+            }
+        }
+
+        // Images already decoded return right away, so dynamic scheduling keeps the big ones from piling up on one thread
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (unsigned i = 0; i < pending.size(); ++i) {
+            pending[i]->get();
+        }
+    }
+
+    std::vector<TextureCache::Usage> TextureCache::usage () {
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        std::vector<Usage> usage;
+
+        for (auto &entry : this->entries) {
+            if (!entry.second->decoded.load(std::memory_order_acquire)) {
+                continue;
+            }
+            const MipMap &mipmap = entry.second->mipmap;
+            usage.push_back({
+                entry.first,
+                mipmap.getWidth(),
+                mipmap.getHeight(),
+                mipmap.getLevels(),
+                this->references[entry.first],
+                mipmap.memory()
+            });
+        }
+
+        return usage;
+    }
+
+    MipBitmap::MipBitmap (const std::string &path, float_max_t width, float_max_t height) :
+        image(TextureCache::instance().request(path)), width(width), height(height) {}
+
+    MipBitmap::~MipBitmap () {
+        TextureCache::instance().release(this->image);
+    }
+
+    Pigment::Color MipBitmap::getColor (const Geometry::Vec<2> &param, const Geometry::Vec<3> &) const {
+
+        if (!std::isfinite(param[0]) || !std::isfinite(param[1])) {
+            return Pigment::Color(0.0, 0.0, 0.0);
+        }
+
+        const MipMap &mipmap = this->image->get();
+        const float_max_t
+            texels_u = Footprint() / (this->stretch_u * this->width) * mipmap.getWidth(),
+            texels_v = Footprint() / (this->stretch_v * this->height) * mipmap.getHeight();
+
+        return mipmap.sample(
+            fract(param[0] / this->width),
+            fract(param[1] / this->height),
+            std::log2(std::max(texels_u, texels_v))
+        );
+    }
+
+    MipTexMap::MipTexMap (const Geometry::Vec<4> &P0, const Geometry::Vec<4> &P1, const std::string &path) :
+        MipBitmap(path), P0(P0), P1(P1) {
+
+        // A step of one scene unit moves the parameters by at most the length of the spatial part of P0 and P1
+        const float_max_t
+            rate_u = std::sqrt(P0[0] * P0[0] + P0[1] * P0[1] + P0[2] * P0[2]),
+            rate_v = std::sqrt(P1[0] * P1[0] + P1[1] * P1[1] + P1[2] * P1[2]);
+
+        this->stretch_u = rate_u > 0.0 ? 1.0 / rate_u : std::numeric_limits<float_max_t>::infinity();
+        this->stretch_v = rate_v > 0.0 ? 1.0 / rate_v : std::numeric_limits<float_max_t>::infinity();
+    }
+
+    Pigment::Color MipTexMap::getColor (const Geometry::Vec<2> &, const Geometry::Vec<3> &point) const {
+        const Geometry::Vec<4> homogeneous({ point[0], point[1], point[2], 1.0 });
+        return MipBitmap::getColor({ this->P0.dot(homogeneous), this->P1.dot(homogeneous) }, point);
+    }
+
+};
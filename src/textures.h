@@ -0,0 +1,172 @@
+#ifndef SRC_TEXTURES_H_
+#define SRC_TEXTURES_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "graphics/graphics.h"
+
+namespace RayTrace {
+
+    // Width, in scene units, of the cone of rays around the one being shaded where it meets the surface. Trace sets
+    // it before evaluating the shading attributes of a hit, which is the only way to reach the pigments through
+    // Shape::intersectLine.
+    float_max_t &Footprint ();
+
+    // Image and every halving of it down to a single texel, each level stored in square tiles of TILE_SIZE texels
+    // per side with the texels of a tile in Morton order, so that a filter footprint touches few cache lines
+    class MipMap {
+
+    public:
+
+        static constexpr unsigned TILE_SIZE = 8;
+
+    private:
+
+        struct Level {
+            unsigned width, height, tiles_x;
+            // Red, green and blue in the lowest three bytes
+            std::vector<std::uint32_t> texels;
+
+            inline std::uint32_t at (unsigned x, unsigned y) const {
+                const unsigned tile = (y / TILE_SIZE) * this->tiles_x + x / TILE_SIZE;
+                return this->texels[tile * TILE_SIZE * TILE_SIZE + MipMap::morton(x % TILE_SIZE, y % TILE_SIZE)];
+            }
+        };
+
+        std::vector<Level> levels;
+
+        static inline unsigned morton (unsigned x, unsigned y) {
+            unsigned index = 0;
+            for (unsigned bit = 0; (1u << bit) < TILE_SIZE; ++bit) {
+                index |= ((x >> bit) & 1u) << (2 * bit);
+                index |= ((y >> bit) & 1u) << (2 * bit + 1);
+            }
+            return index;
+        }
+
+        static Level allocate (unsigned width, unsigned height);
+        static void store (Level &level, unsigned x, unsigned y, const float_max_t rgb[3]);
+
+        // Bilinear lookup at texel coordinates between 0 and the size of the level minus one
+        Pigment::Color bilinear (const Level &level, float_max_t x, float_max_t y) const;
+
+    public:
+
+        MipMap () {}
+        MipMap (const cv::Mat &image);
+
+        inline bool empty () const { return this->levels.empty(); }
+        inline unsigned getWidth () const { return this->empty() ? 0 : this->levels[0].width; }
+        inline unsigned getHeight () const { return this->empty() ? 0 : this->levels[0].height; }
+        inline unsigned getLevels () const { return this->levels.size(); }
+
+        // Bytes taken by the texels of every level
+        std::size_t memory () const;
+
+        // Trilinear lookup at u, v in [0, 1), v growing upwards, level of detail being the log2 of the footprint
+        // in texels of the full image. Like Pigment::Bitmap, both ends of [0, 1) map to the centers of the edge texels.
+        Pigment::Color sample (float_max_t u, float_max_t v, float_max_t lod) const;
+    };
+
+    // Images shared by every pigment of the process that names the same file, each decoded once: either by load,
+    // which spreads the pending ones over all threads, or by whichever thread samples it first. An image is dropped
+    // once the last pigment that requested it releases it.
+    class TextureCache {
+
+    public:
+
+        class Entry {
+
+            friend class TextureCache;
+
+            std::string path;
+            std::once_flag once;
+            std::atomic<bool> decoded { false };
+            MipMap mipmap;
+
+            void decode ();
+
+        public:
+
+            Entry (const std::string &path) : path(path) {}
+
+            inline const std::string &getPath () const { return this->path; }
+
+            inline const MipMap &get () {
+                std::call_once(this->once, &Entry::decode, this);
+                return this->mipmap;
+            }
+        };
+
+        struct Usage {
+            std::string path;
+            unsigned width, height, levels, references;
+            std::size_t bytes;
+        };
+
+    private:
+
+        std::mutex mutex;
+        std::map<std::string, std::unique_ptr<Entry>> entries;
+        std::map<std::string, unsigned> references;
+
+        TextureCache () {}
+
+    public:
+
+        static TextureCache &instance ();
+
+        // Entry for the image at path, created without decoding it when the path is new
+        Entry *request (const std::string &path);
+
+        // Gives back an entry from request, which must no longer be used afterwards
+        void release (Entry *entry);
+
+        // Decodes every image not decoded yet, in parallel
+        void load ();
+
+        // Images decoded so far, in path order
+        std::vector<Usage> usage ();
+    };
+
+    // Drop-in replacement for Pigment::Bitmap that filters through a MipMap by the footprint of the ray
+    class MipBitmap : public Pigment::Texture {
+
+    protected:
+
+        TextureCache::Entry *image;
+        float_max_t width, height;
+        // Scene units per parameter unit along both directions, for turning footprints into texels
+        float_max_t stretch_u = 1.0, stretch_v = 1.0;
+
+    public:
+
+        MipBitmap (const std::string &path, float_max_t width = 1.0, float_max_t height = 1.0);
+        MipBitmap (const MipBitmap &) = delete;
+        MipBitmap &operator= (const MipBitmap &) = delete;
+        ~MipBitmap ();
+
+        Pigment::Color getColor (const Geometry::Vec<2> &param, const Geometry::Vec<3> &point) const override;
+    };
+
+    // Drop-in replacement for Pigment::TexMap<Pigment::Bitmap>, projecting points onto the image with P0 and P1
+    class MipTexMap : public MipBitmap {
+
+        Geometry::Vec<4> P0, P1;
+
+    public:
+
+        MipTexMap (const Geometry::Vec<4> &P0, const Geometry::Vec<4> &P1, const std::string &path);
+
+        Pigment::Color getColor (const Geometry::Vec<2> &param, const Geometry::Vec<3> &point) const override;
+    };
+
+};
+
+#endif
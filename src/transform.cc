@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "transform.h"
+
+namespace RayTrace {
+
+    Affine::Affine () {
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                this->linear[i][j] = i == j ? 1.0 : 0.0;
+            }
+            this->offset[i] = 0.0;
+        }
+    }
+
+    Affine Affine::translation (const Geometry::Vec<3> &translation) {
+        Affine result;
+        for (unsigned i = 0; i < 3; ++i) {
+            result.offset[i] = translation[i];
+        }
+        return result;
+    }
+
+    Affine Affine::scaling (float_max_t sx, float_max_t sy, float_max_t sz) {
+        Affine result;
+        result.linear[0][0] = sx;
+        result.linear[1][1] = sy;
+        result.linear[2][2] = sz;
+        return result;
+    }
+
+    Affine Affine::shearing (float_max_t sxy, float_max_t sxz, float_max_t syx, float_max_t syz, float_max_t szx, float_max_t szy) {
+        Affine result;
+        result.linear[0][1] = sxy;
+        result.linear[0][2] = sxz;
+        result.linear[1][0] = syx;
+        result.linear[1][2] = syz;
+        result.linear[2][0] = szx;
+        result.linear[2][1] = szy;
+        return result;
+    }
+
+    Affine Affine::rotation (const Geometry::Vec<4> &quaternion) {
+
+        const float_max_t x = quaternion[0], y = quaternion[1], z = quaternion[2], w = quaternion[3];
+        const float_max_t u[3] = { x, y, z }, cross[3][3] = { { 0.0, -z, y }, { z, 0.0, -x }, { -y, x, 0.0 } };
+
+        // q v q* = (w^2 - u . u) v + 2 (u . v) u + 2 w (u x v)
+        Affine result;
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                result.linear[i][j] = (i == j ? w * w - (x * x + y * y + z * z) : 0.0) + 2.0 * u[i] * u[j] + 2.0 * w * cross[i][j];
+            }
+        }
+        return result;
+    }
+
+    Affine Affine::around (const Geometry::Vec<3> &pivot) const {
+        Affine result = *this;
+        const Geometry::Vec<3> moved = this->vector(pivot);
+        for (unsigned i = 0; i < 3; ++i) {
+            result.offset[i] += pivot[i] - moved[i];
+        }
+        return result;
+    }
+
+    Affine Affine::operator* (const Affine &other) const {
+        Affine result;
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                result.linear[i][j] = this->linear[i][0] * other.linear[0][j] + this->linear[i][1] * other.linear[1][j] + this->linear[i][2] * other.linear[2][j];
+            }
+            result.offset[i] = this->linear[i][0] * other.offset[0] + this->linear[i][1] * other.offset[1] + this->linear[i][2] * other.offset[2] + this->offset[i];
+        }
+        return result;
+    }
+
+    bool Affine::invert (Affine &inverse) const {
+
+        const float_max_t (&m)[3][3] = this->linear;
+
+        // Cofactors, transposed
+        const float_max_t adjugate[3][3] = {
+            { m[1][1] * m[2][2] - m[1][2] * m[2][1], m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][1] * m[1][2] - m[0][2] * m[1][1] },
+            { m[1][2] * m[2][0] - m[1][0] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][2] * m[1][0] - m[0][0] * m[1][2] },
+            { m[1][0] * m[2][1] - m[1][1] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1], m[0][0] * m[1][1] - m[0][1] * m[1][0] }
+        };
+        const float_max_t determinant = m[0][0] * adjugate[0][0] + m[0][1] * adjugate[1][0] + m[0][2] * adjugate[2][0];
+
+        if (determinant == 0.0 || !std::isfinite(determinant)) {
+            return false;
+        }
+
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                inverse.linear[i][j] = adjugate[i][j] / determinant;
+            }
+        }
+        for (unsigned i = 0; i < 3; ++i) {
+            inverse.offset[i] = -(inverse.linear[i][0] * this->offset[0] + inverse.linear[i][1] * this->offset[1] + inverse.linear[i][2] * this->offset[2]);
+        }
+
+        return true;
+    }
+
+    Geometry::Vec<3> Affine::point (const Geometry::Vec<3> &point) const {
+        const Geometry::Vec<3> moved = this->vector(point);
+        return Geometry::Vec<3>({ moved[0] + this->offset[0], moved[1] + this->offset[1], moved[2] + this->offset[2] });
+    }
+
+    Geometry::Vec<3> Affine::vector (const Geometry::Vec<3> &vector) const {
+        const float_max_t (&m)[3][3] = this->linear;
+        return Geometry::Vec<3>({
+            m[0][0] * vector[0] + m[0][1] * vector[1] + m[0][2] * vector[2],
+            m[1][0] * vector[0] + m[1][1] * vector[1] + m[1][2] * vector[2],
+            m[2][0] * vector[0] + m[2][1] * vector[1] + m[2][2] * vector[2]
+        });
+    }
+
+    Geometry::Vec<3> Affine::transposed (const Geometry::Vec<3> &vector) const {
+        const float_max_t (&m)[3][3] = this->linear;
+        return Geometry::Vec<3>({
+            m[0][0] * vector[0] + m[1][0] * vector[1] + m[2][0] * vector[2],
+            m[0][1] * vector[0] + m[1][1] * vector[1] + m[2][1] * vector[2],
+            m[0][2] * vector[0] + m[1][2] * vector[1] + m[2][2] * vector[2]
+        });
+    }
+
+    float_max_t Affine::similarity () const {
+
+        const float_max_t (&m)[3][3] = this->linear;
+        float_max_t gram[3][3];
+
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                gram[i][j] = m[0][i] * m[0][j] + m[1][i] * m[1][j] + m[2][i] * m[2][j];
+            }
+        }
+
+        // Columns of equal length at right angles, up to the rounding of the quaternions and scales they came from
+        const float_max_t
+            square = (gram[0][0] + gram[1][1] + gram[2][2]) / 3.0,
+            tolerance = 64.0 * std::numeric_limits<float_max_t>::epsilon() * square;
+
+        if (!(square > 0.0) || !std::isfinite(square)) {
+            return 0.0;
+        }
+
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                if (std::abs(gram[i][j] - (i == j ? square : 0.0)) > tolerance) {
+                    return 0.0;
+                }
+            }
+        }
+
+        return std::sqrt(square);
+    }
+
+    bool Affine::diagonal () const {
+        for (unsigned i = 0; i < 3; ++i) {
+            for (unsigned j = 0; j < 3; ++j) {
+                if (i != j && this->linear[i][j] != 0.0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    Bounds Affine::apply (const Bounds &bounds) const {
+
+        if (bounds.isEmpty()) {
+            return Bounds();
+        } else if (!bounds.isFinite()) {
+            return Bounds::infinite();
+        }
+
+        // The center moves as a point and the half extents grow by the absolute value of the linear part
+        Bounds result;
+        for (unsigned i = 0; i < 3; ++i) {
+            float_max_t center = this->offset[i], extent = 0.0;
+            for (unsigned j = 0; j < 3; ++j) {
+                center += this->linear[i][j] * bounds.centroid(j);
+                extent += std::abs(this->linear[i][j]) * (bounds.max[j] - bounds.min[j]) * 0.5;
+            }
+            result.min[i] = center - extent;
+            result.max[i] = center + extent;
+        }
+
+        return result;
+    }
+
+    Transformed::Transformed (const ::Shape::Shape *shape, const Affine &to_world) :
+        ::Shape::Shape(nullptr, nullptr),
+        shape(shape),
+        to_world(to_world) {
+        this->to_world.invert(this->to_local);
+    }
+
+    bool Transformed::intersectLine (
+        const Geometry::Line &line,
+        float_max_t &t_min,
+        float_max_t &t_max,
+        bool get_info,
+        Geometry::Vec<3> &normal_min,
+        Geometry::Vec<3> &normal_max,
+        bool &inside_min,
+        bool &inside_max,
+        Pigment::Color &color_min,
+        Pigment::Color &color_max,
+        Light::Material &material_min,
+        Light::Material &material_max
+    ) const {
+
+        const Geometry::Vec<3> direction = this->to_local.vector(line.getDirection());
+        const float_max_t length = direction.length();
+
+        // Distances along the unit direction in the space of the shape are length times those in the world
+        if (!this->shape->intersectLine(
+            Geometry::Line(this->to_local.point(line.at(0.0)), direction * (1.0 / length)),
+            t_min, t_max, get_info, normal_min, normal_max, inside_min, inside_max, color_min, color_max, material_min, material_max
+        )) {
+            return false;
+        }
+
+        t_min /= length;
+        t_max /= length;
+
+        if (get_info) {
+            normal_min = this->to_local.transposed(normal_min).normalized();
+            normal_max = this->to_local.transposed(normal_max).normalized();
+        }
+
+        return true;
+    }
+
+};
@@ -0,0 +1,78 @@
+#ifndef SRC_TRANSFORM_H_
+#define SRC_TRANSFORM_H_
+
+#include "graphics/graphics.h"
+#include "bvh.h"
+
+namespace RayTrace {
+
+    // Affine map of points, linear * x + offset
+    struct Affine {
+
+        float_max_t linear[3][3], offset[3];
+
+        // The identity
+        Affine ();
+
+        static Affine translation (const Geometry::Vec<3> &translation);
+        static Affine scaling (float_max_t sx, float_max_t sy, float_max_t sz);
+        static Affine shearing (float_max_t sxy, float_max_t sxz, float_max_t syx, float_max_t syz, float_max_t szx, float_max_t szy);
+        // Quaternion x, y, z and w, rotating as q v q* does
+        static Affine rotation (const Geometry::Vec<4> &quaternion);
+
+        // The same map with pivot, rather than the origin, kept in place
+        Affine around (const Geometry::Vec<3> &pivot) const;
+
+        // Applies other first and then this one
+        Affine operator* (const Affine &other) const;
+
+        bool invert (Affine &inverse) const;
+
+        Geometry::Vec<3> point (const Geometry::Vec<3> &point) const;
+        Geometry::Vec<3> vector (const Geometry::Vec<3> &vector) const;
+        // Transpose of the linear part times vector, which carries normals through the inverse map
+        Geometry::Vec<3> transposed (const Geometry::Vec<3> &vector) const;
+
+        // Factor s when the linear part is s times a rotation or reflection, 0 otherwise
+        float_max_t similarity () const;
+        // Whether the linear part only scales along the axes
+        bool diagonal () const;
+
+        // Box around the image of bounds
+        Bounds apply (const Bounds &bounds) const;
+    };
+
+    // Shape seen through a single affine map. Nested transforms are folded into one, so a ray is only carried
+    // into the space of the shape once, and normals come back through the inverse transpose kept along with it.
+    class Transformed : public Shape::Shape {
+
+        const ::Shape::Shape *shape;
+        Affine to_world, to_local;
+
+    public:
+
+        // to_world must be invertible
+        Transformed (const ::Shape::Shape *shape, const Affine &to_world);
+
+        inline const ::Shape::Shape *getShape () const { return this->shape; }
+        inline const Affine &getTransform () const { return this->to_world; }
+
+        bool intersectLine (
+            const Geometry::Line &line,
+            float_max_t &t_min,
+            float_max_t &t_max,
+            bool get_info,
+            Geometry::Vec<3> &normal_min,
+            Geometry::Vec<3> &normal_max,
+            bool &inside_min,
+            bool &inside_max,
+            Pigment::Color &color_min,
+            Pigment::Color &color_max,
+            Light::Material &material_min,
+            Light::Material &material_max
+        ) const override;
+    };
+
+};
+
+#endif